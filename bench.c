@@ -0,0 +1,395 @@
+/*
+ *  bench.c
+ *  Contains a synthetic page fault generator used to measure what the pf_probe modules cost
+ *
+ *  Author :
+ *  Sagar Vishwakarma (svishwa2@binghamton.edu)
+ *  State University of New York, Binghamton
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+
+#define BENCH_PAGES 16384
+#define BENCH_THREADS 4
+#define BENCH_RUNS 5
+#define BENCH_MAX_THREADS 64
+#define BENCH_MAX_RUNS 64
+#define BENCH_FILE_NAME "./out/bench.dat"
+#define BENCH_HEADER "label,workload,threads,pages,runs,faults,ns_per_fault,ns_per_fault_min,ns_per_page,faults_per_sec"
+
+
+/* One timed run of a workload */
+typedef struct bench_result {
+	long faults;
+	long ns;
+} bench_result;
+
+/*
+ * Share of a workload touched by one thread: pages first up to last of area, visited through order
+ * when it is set. A thread given no area maps its own last - first pages with map_flags once started.
+ */
+typedef struct bench_thread {
+	pthread_t thread;
+	pthread_barrier_t *start;
+	int write;
+	int own;
+	int map_flags;
+	char *area;
+	long *order;
+	long first;
+	long last;
+} bench_thread;
+
+typedef int (*bench_fn)(long, int, bench_result *);
+
+typedef struct bench_workload {
+	const char *name;
+	bench_fn run;
+} bench_workload;
+
+
+static long page_size;
+static const char *file_name = BENCH_FILE_NAME;
+
+
+long now_ns(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+/* Minor and major faults taken by every thread of this process so far */
+long fault_count(void) {
+
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_minflt + usage.ru_majflt;
+}
+
+
+void *map_anon(long pages, int flags) {
+
+	void *area = mmap(NULL, pages * page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+
+	return area == MAP_FAILED ? NULL : area;
+}
+
+
+void *bench_worker(void *arg) {
+
+	bench_thread *bench = (bench_thread *)arg;
+	volatile char *area;
+	long page;
+	long idx;
+
+	pthread_barrier_wait(bench->start);
+	if (bench->own) {
+		bench->area = map_anon(bench->last - bench->first, bench->map_flags);
+		if (bench->area == NULL) {
+			return NULL;
+		}
+	}
+	area = bench->area;
+	for (idx = bench->first; idx < bench->last; idx++) {
+		page = bench->order != NULL ? bench->order[idx] : idx - (bench->own ? bench->first : 0);
+		if (bench->write) {
+			area[page * page_size] = 1;
+		}
+		else {
+			(void)area[page * page_size];
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * Split pages between threads that start together and time them from the start to the last join.
+ * The threads share area, or with area NULL each one maps its own share with map_flags.
+ */
+int run_threads(int threads, char *area, long *order, long pages, int write, int map_flags, bench_result *result) {
+
+	bench_thread *bench = calloc(threads, sizeof(bench_thread));
+	pthread_barrier_t start_barrier;
+	long start_faults;
+	long start;
+	int errors = 0;
+	int idx;
+
+	if (bench == NULL) {
+		return -1;
+	}
+	pthread_barrier_init(&start_barrier, NULL, threads + 1);
+	for (idx = 0; idx < threads; idx++) {
+		bench[idx].start = &start_barrier;
+		bench[idx].write = write;
+		bench[idx].own = area == NULL;
+		bench[idx].map_flags = map_flags;
+		bench[idx].area = area;
+		bench[idx].order = order;
+		bench[idx].first = pages * idx / threads;
+		bench[idx].last = pages * (idx + 1) / threads;
+		if (pthread_create(&bench[idx].thread, NULL, bench_worker, &bench[idx]) != 0) {
+			fprintf(stderr, "Failed to start bench thread %d\n", idx);
+			exit(errno);
+		}
+	}
+	// taken before the barrier, so the mmap of an own share and every page fault after it are counted
+	start_faults = fault_count();
+	start = now_ns();
+	pthread_barrier_wait(&start_barrier);
+	for (idx = 0; idx < threads; idx++) {
+		pthread_join(bench[idx].thread, NULL);
+	}
+	result->ns = now_ns() - start;
+	result->faults = fault_count() - start_faults;
+	for (idx = 0; idx < threads; idx++) {
+		if (bench[idx].own && bench[idx].area != NULL) {
+			munmap(bench[idx].area, (bench[idx].last - bench[idx].first) * page_size);
+		}
+		else if (bench[idx].own) {
+			errors = -1;
+		}
+	}
+	pthread_barrier_destroy(&start_barrier);
+	free(bench);
+	return errors;
+}
+
+
+/* First write to every page of a fresh anonymous mapping, in address order, each thread writing its own range */
+int bench_seq(long pages, int threads, bench_result *result) {
+
+	char *area = map_anon(pages, 0);
+	int errors;
+
+	if (area == NULL) {
+		return -1;
+	}
+	errors = run_threads(threads, area, NULL, pages, 1, 0, result);
+	munmap(area, pages * page_size);
+	return errors;
+}
+
+
+/* First write to every page in a shuffled order, so neither the tracer nor the kernel sees a stride */
+int bench_rand(long pages, int threads, bench_result *result) {
+
+	char *area = map_anon(pages, 0);
+	long *order = malloc(pages * sizeof(long));
+	uint64_t seed = 0x9e3779b97f4a7c15ULL;
+	long swap;
+	long idx;
+	long pick;
+	int errors;
+
+	if (area == NULL || order == NULL) {
+		if (area != NULL) {
+			munmap(area, pages * page_size);
+		}
+		free(order);
+		return -1;
+	}
+	for (idx = 0; idx < pages; idx++) {
+		order[idx] = idx;
+	}
+	for (idx = pages - 1; idx > 0; idx--) {
+		// xorshift64, the same order on every run
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		pick = seed % (idx + 1);
+		swap = order[idx];
+		order[idx] = order[pick];
+		order[pick] = swap;
+	}
+	errors = run_threads(threads, area, order, pages, 1, 0, result);
+	munmap(area, pages * page_size);
+	free(order);
+	return errors;
+}
+
+
+/* Read every page of a shared file mapping whose pages are already in the page cache */
+int bench_file(long pages, int threads, bench_result *result) {
+
+	char *buffer = calloc(1, page_size);
+	char *area;
+	long idx;
+	int errors;
+	int fd;
+
+	fd = open(file_name, O_RDWR | O_CREAT, 0600);
+	if (fd < 0 || buffer == NULL) {
+		free(buffer);
+		return -1;
+	}
+	for (idx = 0; idx < pages; idx++) {
+		if (write(fd, buffer, page_size) != page_size) {
+			close(fd);
+			free(buffer);
+			return -1;
+		}
+	}
+	free(buffer);
+	area = mmap(NULL, pages * page_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (area == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	// fault around maps several cached pages per fault, so faults comes out below pages
+	errors = run_threads(threads, area, NULL, pages, 0, 0, result);
+	munmap(area, pages * page_size);
+	close(fd);
+	unlink(file_name);
+	return errors;
+}
+
+
+/* Every thread faults its own mapping at once, so all CPUs hit the probes together without sharing a vma */
+int bench_storm(long pages, int threads, bench_result *result) {
+	return run_threads(threads, NULL, NULL, pages, 1, 0, result);
+}
+
+
+/* Baseline with MAP_POPULATE: each thread has the kernel fill its mapping in mmap, then its writes take no fault */
+int bench_populate(long pages, int threads, bench_result *result) {
+	return run_threads(threads, NULL, NULL, pages, 1, MAP_POPULATE, result);
+}
+
+
+static bench_workload workloads[] = {
+	{ "seq", bench_seq },
+	{ "rand", bench_rand },
+	{ "file", bench_file },
+	{ "storm", bench_storm },
+	{ "populate", bench_populate },
+};
+
+
+int cmp_ns_per_fault(const void *a, const void *b) {
+
+	const bench_result *left = (const bench_result *)a;
+	const bench_result *right = (const bench_result *)b;
+	double x = (double)left->ns / (left->faults > 0 ? left->faults : 1);
+	double y = (double)right->ns / (right->faults > 0 ? right->faults : 1);
+
+	return x < y ? -1 : x > y;
+}
+
+
+/* Run one workload runs times and print its csv line, the median run stands for the workload */
+int run_workload(bench_workload *workload, const char *label, long pages, int threads, int runs) {
+
+	bench_result result[BENCH_MAX_RUNS];
+	bench_result *median;
+	int idx;
+
+	for (idx = 0; idx < runs; idx++) {
+		if (workload->run(pages, threads, &result[idx]) < 0) {
+			fprintf(stderr, "Workload %s failed: %s\n", workload->name, strerror(errno));
+			return errno;
+		}
+	}
+	qsort(result, runs, sizeof(bench_result), cmp_ns_per_fault);
+	median = &result[runs / 2];
+	printf("%s,%s,%d,%ld,%d,%ld,%.1f,%.1f,%.1f,%.0f\n", label, workload->name, threads, pages, runs, median->faults,
+		(double)median->ns / (median->faults > 0 ? median->faults : 1),
+		(double)result[0].ns / (result[0].faults > 0 ? result[0].faults : 1),
+		(double)median->ns / pages,
+		median->ns > 0 ? median->faults * 1e9 / median->ns : 0.0);
+	fflush(stdout);
+	return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+
+	const char *label = "none";
+	char *selected = NULL;
+	char *name;
+	long pages = BENCH_PAGES;
+	int threads = BENCH_THREADS;
+	int runs = BENCH_RUNS;
+	int header = 1;
+	int errors = 0;
+	int found;
+	int opt;
+	size_t idx;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	while ((opt = getopt(argc, argv, "l:w:n:t:r:f:H")) != -1) {
+		switch (opt) {
+			case 'l':
+				label = optarg;
+				break;
+			case 'w':
+				selected = optarg;
+				break;
+			case 'n':
+				pages = strtol(optarg, NULL, 0);
+				break;
+			case 't':
+				threads = atoi(optarg);
+				break;
+			case 'r':
+				runs = atoi(optarg);
+				break;
+			case 'f':
+				file_name = optarg;
+				break;
+			case 'H':
+				header = 0;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-l <label>] [-w <workload,...>] [-n <pages>] [-t <threads>] [-r <runs>] [-f <file>] [-H]\n", argv[0]);
+				fprintf(stderr, "  -l  label of the configuration being measured, first csv column (default none)\n");
+				fprintf(stderr, "  -w  workloads to run out of seq,rand,file,storm,populate (default all)\n");
+				fprintf(stderr, "  -n  pages touched per run (default %d), split between the threads\n", BENCH_PAGES);
+				fprintf(stderr, "  -t  threads faulting at once in every workload (default %d, max %d)\n", BENCH_THREADS, BENCH_MAX_THREADS);
+				fprintf(stderr, "  -r  runs per workload, the median is reported (default %d, max %d)\n", BENCH_RUNS, BENCH_MAX_RUNS);
+				fprintf(stderr, "  -f  file backing the file workload (default %s)\n", BENCH_FILE_NAME);
+				fprintf(stderr, "  -H  leave out the csv header line\n");
+				return EINVAL;
+		}
+	}
+	if (pages <= 0 || threads <= 0 || threads > BENCH_MAX_THREADS || runs <= 0 || runs > BENCH_MAX_RUNS) {
+		fprintf(stderr, "Pages, threads and runs must be positive, with at most %d threads and %d runs\n", BENCH_MAX_THREADS, BENCH_MAX_RUNS);
+		return EINVAL;
+	}
+
+	if (header) {
+		printf("%s\n", BENCH_HEADER);
+	}
+	for (idx = 0; idx < sizeof(workloads) / sizeof(workloads[0]); idx++) {
+		found = selected == NULL;
+		if (!found) {
+			// match whole names in the comma separated list
+			name = strstr(selected, workloads[idx].name);
+			while (name != NULL && !found) {
+				found = (name == selected || name[-1] == ',') && (name[strlen(workloads[idx].name)] == ',' || name[strlen(workloads[idx].name)] == '\0');
+				name = strstr(name + 1, workloads[idx].name);
+			}
+		}
+		if (found) {
+			errors |= run_workload(&workloads[idx], label, pages, threads, runs);
+		}
+	}
+	return errors;
+}
@@ -0,0 +1,69 @@
+#! /bin/bash
+###### Measure what each module and capture mode costs per page fault
+###### Usage: sudo ./bench.sh [-b <baseline csv>] [-p <percent>] [bench options]
+###### Results go to ./out/bench.csv, one csv line per configuration and workload
+out=./out/bench.csv
+baseline=""
+percent=10
+while getopts "b:p:" opt; do
+	case $opt in
+		b) baseline=$OPTARG ;;
+		p) percent=$OPTARG ;;
+		*) exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+args=$*
+fifo=$(mktemp -u)
+mkfifo $fifo
+
+###### Run the benchmark with the module loaded on its own pid
+run() {
+	label=$1
+	module=$2
+	shift 2
+	if [ -z "$module" ]; then
+		./bench -H -l $label $args >> $out
+		return
+	fi
+	###### exec keeps the pid of the subshell, so the module traces the benchmark from its first fault
+	(read go < $fifo; exec ./bench -H -l $label $args) >> $out &
+	pid=$!
+	if ! sudo insmod $module.ko process_id=$pid $*; then
+		echo "Skipping $label, $module did not load" >&2
+		kill $pid
+		wait $pid
+		return
+	fi
+	echo go > $fifo
+	wait $pid
+	sudo rmmod $module
+}
+
+./bench -l header -w none > $out
+run none ""
+run A pf_probe_A
+run B pf_probe_B
+run C pf_probe_C
+run B_tracepoint pf_probe_B attach=tracepoint
+run B_ftrace pf_probe_B attach=ftrace
+run B_latency pf_probe_B latency=1
+run B_stats_only pf_probe_B store_records=0
+run B_compact pf_probe_B compact=1
+run B_compact_line pf_probe_B compact=2
+run B_hot pf_probe_B hot_pages=4096
+run B_no_heat pf_probe_B heat_window_ms=0
+run B_sample_16 pf_probe_B sample_every=16
+run B_sample_adaptive pf_probe_B sample_rate=100000
+rm -f $fifo
+cat $out
+
+###### Compare ns_per_fault with an earlier run, fail when any configuration got slower than percent
+if [ -n "$baseline" ]; then
+	awk -F, -v percent=$percent '
+		NR == FNR { if (FNR > 1) base[$1 "," $2] = $7; next }
+		FNR > 1 && ($1 "," $2) in base && base[$1 "," $2] > 0 && $7 > base[$1 "," $2] * (1 + percent / 100) {
+			printf("REGRESSION %s %s: %.1f ns per fault, was %.1f\n", $1, $2, $7, base[$1 "," $2]); failed = 1
+		}
+		END { exit failed }' $baseline $out
+fi
@@ -1,6 +1,7 @@
 #!/bin/python
 import os
 import sys
+import struct
 import numpy as np
 from matplotlib import pyplot as plt
 
@@ -74,10 +75,68 @@ def print_page_fault(address_array, time_array, process_id):
 	return 0
 
 
+def read_varint(block, pos):
+	value = 0
+	shift = 0
+	while True:
+		byte = block[pos]
+		pos += 1
+		value |= (byte & 0x7f) << shift
+		if byte < 0x80:
+			return value, pos
+		shift += 7
+
+
+def unzigzag(value):
+	return (value >> 1) ^ -(value & 1)
+
+
+def load_trace(file_path):
+	# binary trace written by "user -t", see trace_header in user.c, blocks are walked by their headers
+	address_list = []
+	time_list = []
+	process_id = 0
+	with open(file_path, "rb") as fd:
+		data = fd.read()
+	pos = 16
+	while pos + 32 <= len(data) and data[pos:pos+4] == b"PFB1":
+		records, length = struct.unpack_from("<II", data, pos + 4)
+		block = data[pos+32:pos+32+length]
+		pos += 32 + length
+		if len(block) != length:
+			break
+		offset = 0
+		time = address = pid = 0
+		for _ in range(records):
+			value, offset = read_varint(block, offset)
+			time += unzigzag(value)
+			value, offset = read_varint(block, offset)
+			address += unzigzag(value)
+			value, offset = read_varint(block, offset)
+			pid += unzigzag(value)
+			value, offset = read_varint(block, offset)
+			# tgid is not plotted
+			flags, offset = read_varint(block, offset)
+			if flags & 0x1:
+				value, offset = read_varint(block, offset)
+				value, offset = read_varint(block, offset)
+			time_list.append(time)
+			address_list.append(address)
+			if (process_id == 0):
+				process_id = pid
+	return np.array(address_list), np.array(time_list), process_id
+
+
 def process_file(file_path):
 	# file_path = "./pf_probe_B.log"
 	lines = None
 	if os.path.exists(file_path):
+		with open(file_path, "rb") as fd:
+			magic = fd.read(4)
+		if magic == b"PFT1":
+			address_array, time_array, process_id = load_trace(file_path)
+			plot_page_fault(address_array, time_array, process_id)
+			return 0
 		with open(file_path) as fd:
 			lines = fd.readlines()
 
@@ -87,12 +146,13 @@ def process_file(file_path):
 		# process file
 		for line in lines:
 			# line = lines[1]
-			line_split = line.split(" ")
+			# fields are found by name, lines from latency mode carry extra "Latency <ns> Ret <hex>" fields
+			line_split = line.split()
 			if (("Address" in line_split)and("Time" in line_split)):
-				time_list.append(int(line_split[-1].strip("\n")))
-				address_list.append(int(line_split[-4], 0))
+				time_list.append(int(line_split[line_split.index("Time")+1]))
+				address_list.append(int(line_split[line_split.index("Address")+1], 0))
 				if (process_id == 0):
-					process_id = int(line_split[-9])
+					process_id = int(line_split[line_split.index("PID")+2])
 		address_array = np.array(address_list)
 		time_array = np.array(time_list)
 		# time_array.max() - time_array.min()
@@ -105,7 +165,7 @@ def process_file(file_path):
 
 def main():
 	if len(sys.argv) != 2:
-		print("Usage: python {0} <path of user read log file>".format(sys.argv[0]))
+		print("Usage: python {0} <path of user read log file or binary trace>".format(sys.argv[0]))
 		return -1
 	else:
 		file_path = sys.argv[1]
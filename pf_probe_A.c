@@ -10,17 +10,41 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/kprobes.h>
+#include <linux/tracepoint.h>
+#include <linux/ftrace.h>
 #include <linux/uaccess.h>
 #include <linux/ktime.h>
 #include <linux/memory.h>
 #include <linux/memcontrol.h>
 #include <linux/proc_fs.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/hash.h>
+#include <linux/sched.h>
+#include <linux/rcupdate.h>
+#include <linux/version.h>
+#include <linux/sched/signal.h>
+#include <linux/binfmts.h>
+#include <linux/spinlock.h>
+#include <linux/seq_file.h>
+#include <linux/bitops.h>
+#include <linux/math64.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/irq_work.h>
+#include <linux/workqueue.h>
+#include <linux/jump_label.h>
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Sagar Vishwakarma");
 MODULE_DESCRIPTION("A Simple Linux Page Faults Tracking Device");
 MODULE_VERSION("1.0");
 
+/* Load time defaults of the probe_debug, probe_print and cont_store switches */
 #define PROBE_DEBUG 0
 #define PROBE_PRINT 1 // on while submiting the code
 #define CONT_STORE 0
@@ -28,46 +52,490 @@ MODULE_VERSION("1.0");
 #define PROBE_NAME "pf_probe_A"
 
 #define PROBE_STR_LEN 128
+#define PROBE_LINE_LEN 192	// longest text line of one fault, with latency and seq
+#define PROBE_LOG_SLOTS	128	// messages buffered per CPU for the flush worker, power of two
+#define PROBE_LOG_BATCH	64	// messages one CPU hands to printk per flush
+#define PROBE_LOG_FLUSH_MS	100
 #define PROBE_BUFFER_SIZE	1000
+#define PROBE_BUFFER_MAX	(1 << 24)
+#define PROBE_READ_BATCH	16
 #define MAX_SYMBOL_LEN	64
+#define PROBE_TARGET_BITS	12
+#define PROBE_TARGET_SLOTS	(1 << PROBE_TARGET_BITS)
+#define PROBE_MAX_TARGETS	3072	// three quarters of the slots, so probe runs stay short
+#define PROBE_TARGET_TOMBSTONE	(-1)	// slot of a removed target, lookups probe past it
+#define PROBE_CTL_LEN	256	// longest write to /proc/<module>/ctl
+#define PROBE_HIST_BUCKETS	64
+#define PROBE_HIST_WIDTH	40
+#define PROBE_HOT_MAX	(1 << 20)
+#define PROBE_HOT_PROBE	8	// slots searched for a page, and for a victim when they are all taken
+#define PROBE_HOT_TOP	32
+#define PROBE_HOT_CANDIDATES	(4 * PROBE_HOT_TOP)	// hottest pages of each CPU merged by a read of hot
+#define PROBE_HEAT_ROWS	32
+#define PROBE_HEAT_COLS	64	// power of two, a column is reused once its time slot leaves the window
+#define PROBE_ATTACH_KPROBE	0
+#define PROBE_ATTACH_TRACEPOINT	1
+#define PROBE_ATTACH_FTRACE	2
+#define PROBE_ATTACH_MODES	3
+#define PROBE_TRACEPOINTS	2
+#define PROBE_FORK_TRACEPOINTS	3
+#define PROBE_PF_WRITE	0x2	// X86_PF_WRITE bit of the page fault error code
+#define PROBE_PF_USER	0x4	// X86_PF_USER
+#define PROBE_SAMPLE_MAX_SHIFT	15	// widest sampling interval, a record stands for at most 1 << 15 faults
+#define PROBE_SAMPLE_WINDOW	(NSEC_PER_SEC / 10)	// sample_rate compares the fault rate of each window of this length
+
+/* page_fault_data flags */
+#define PROBE_REC_LATENCY	0x0001	// latency and ret are valid
+#define PROBE_REC_WRITE	0x0002	// FAULT_FLAG_WRITE, read fault otherwise
+#define PROBE_REC_USER	0x0004	// FAULT_FLAG_USER, kernel mode access otherwise
+#define PROBE_REC_FILE	0x0008	// file backed vma, anonymous otherwise
+#define PROBE_REC_MAJOR	0x0010	// VM_FAULT_MAJOR, only known with latency=1
+#define PROBE_REC_CLASS_SHIFT	1
+#define PROBE_REC_WEIGHT_SHIFT	8	// bits 8-11 hold log2 of the faults a sampled record stands for
+#define PROBE_REC_WEIGHT_MASK	0xf
+#define PROBE_CLASSES	16	// every combination of the four class bits
+#define PROBE_MMAP_MAGIC	0x50465242	// "PFRB"
+#define PROBE_SEQ_CPU_SHIFT	48	// seq holds the CPU above this bit and a count from 1 of the faults that CPU tried to store
+
+/* compact record words, bit 63 clear: page number, nsec since the previous record and flags bits 1-7 */
+#define PROBE_PACK_ESCAPE	(1ULL << 63)	// not a fault, the payload applies to the records after it
+#define PROBE_PACK_VPN	(1ULL << 62)	// escape payload is the page number of the next record, a new time base otherwise
+#define PROBE_PACK_PAYLOAD	((1ULL << 62) - 1)
+#define PROBE_PACK_SEQ	(1ULL << 61)	// with PROBE_PACK_VPN the payload is the seq of the next record instead
+#define PROBE_PACK_MAX_WORDS	4	// time base, seq and page number escapes and the record itself
+#define PROBE_PACK_FLAG_BITS	7
+#define PROBE_PACK_DELTA_SHIFT	7
+#define PROBE_PACK_DELTA_BITS	21	// compact=2 gives the top PROBE_PACK_LINE_BITS to the 64 byte line in the page
+#define PROBE_PACK_LINE_BITS	6
+#define PROBE_PACK_VPN_SHIFT	28
+#define PROBE_PACK_VPN_BITS	35
+#define PROBE_PACK_TIME_BITS	58	// a time base escape keeps the record weight in the payload bits above the time
+#define PROBE_PACK_SYNC	512	// words between forced time bases, so a lapped reader finds one again
 
 
 static pid_t process_id = 0;
+static int pid_list[PROBE_MAX_TARGETS];
+static int pid_list_len = 0;
+static bool match_tgid = 1;
+static bool follow_fork = 0;
+static bool latency = 0;
+static bool store_records = 1;
+static unsigned int hot_pages = 0;
+static unsigned long hot_size;
+static unsigned int heat_window_ms = 8000;
+static unsigned int heat_col_shift;
+static int latency_maxactive = 0;
+static unsigned int buffer_size = PROBE_BUFFER_SIZE;
+static unsigned long ring_size;
+static unsigned long ring_mask;
+static unsigned int compact = 0;
+static unsigned int sample_every = 1;
+static unsigned int sample_us = 0;
+static unsigned int sample_rate = 0;
+static size_t record_size;
+static bool read_binary = 0;
+static bool read_block = 0;
+static unsigned int wakeup_batch = 64;
+static unsigned int wakeup_ms = 100;
+static unsigned int print_rate = 1000;
 static int probe_open_counter = 0;
 static int probe_ret = -2;
-static int data_buffer_idx = -1;
+static int attach_mode;
+static char attach[16] = "kprobe";
+static const char *attach_names[PROBE_ATTACH_MODES] = { "kprobe", "tracepoint", "ftrace" };
+static const char *fault_tracepoint_names[PROBE_TRACEPOINTS] = { "page_fault_user", "page_fault_kernel" };
+static struct tracepoint *fault_tracepoints[PROBE_TRACEPOINTS];
+static bool fault_tracepoint_on[PROBE_TRACEPOINTS];
+static const char *fork_tracepoint_names[PROBE_FORK_TRACEPOINTS] = { "sched_process_fork", "sched_process_exec", "sched_process_exit" };
+static struct tracepoint *fork_tracepoints[PROBE_FORK_TRACEPOINTS];
+static bool fork_tracepoint_on[PROBE_FORK_TRACEPOINTS];
+struct proc_dir_entry *dev_dir_entry;
 struct proc_dir_entry *dev_file_entry;
 
 
 typedef struct page_fault_data {
 	unsigned long address;
 	long time;
+	pid_t pid;
+	pid_t tgid;
+	u32 latency;
+	u16 ret;
+	u16 flags;
+	u64 seq;	// see PROBE_SEQ_CPU_SHIFT, a gap means records were dropped or overwritten, 0 if unknown
 } page_fault_data;
 
 
+/* Per instance data of the kretprobe, carried from entry to return of the probed function */
+typedef struct page_fault_instance {
+	unsigned long address;
+	ktime_t time;
+	u16 flags;
+} page_fault_instance;
+
+
+/*
+ * First page of the mmap() view, ring N starts at page 1 + N * ring_pages.
+ * Each ring is a page_fault_ring_ctrl page followed by ring_size records.
+ */
+typedef struct page_fault_mmap_info {
+	__u32 magic;
+	__s32 process_id;
+	__u32 nr_rings;
+	__u32 ring_pages;
+	__u32 record_size;
+	__u32 ring_size;
+	__u32 compact;	// records are packed u64 words, see PROBE_PACK_*
+} page_fault_mmap_info;
+
+
+/*
+ * Shared head/tail of one ring, head is only written by the producer and tail by the consumers:
+ * the mmap consumer, and read() cursors through release_ring_slots. They sit two cache lines apart
+ * so the producer and consumers never write the same line.
+ */
+typedef struct page_fault_ring_ctrl {
+	__u64 head;
+	__u64 dropped;	// faults not stored because the ring was full
+	__u64 overwritten;	// slots written over with cont_store before the mmap consumer released them
+	__u64 start;	// a reset through ctl discarded everything before this position
+	__u64 pad[12];
+	__u64 tail;
+} page_fault_ring_ctrl;
+
+
+/* One page of the hot page map, keyed by virtual page number */
+typedef struct page_fault_hot {
+	unsigned long vpn;
+	u64 count;
+	long first_time;
+	long last_time;
+} page_fault_hot;
+
+/* Counts of the target in one slot of target_table on one CPU, only valid while gen matches target_gen of the slot */
+typedef struct page_fault_target {
+	u64 faults;	// scaled like class_count
+	u64 stored;
+	long last;
+	unsigned int gen;
+} page_fault_target;
+
+
+/*
+ * Fault counts of the recent past on one CPU, PROBE_HEAT_COLS columns of 1 << heat_col_shift nsec
+ * by PROBE_HEAT_ROWS rows of 1 << row_shift bytes starting at base. Rows are widened by folding
+ * pairs together when a fault lands outside them, row_shift is 0 until the first fault.
+ */
+typedef struct page_fault_heat {
+	unsigned long base;
+	unsigned int row_shift;
+	u64 slot[PROBE_HEAT_COLS];	// time slot a column is counting
+	u32 cells[PROBE_HEAT_COLS][PROBE_HEAT_ROWS];
+} page_fault_heat;
+
+/*
+ * Messages of the fault path, written by the CPU that owns the log and printed later by flush_fault_log.
+ * head and tail count messages, suppressed counts those dropped by print_rate or a full log.
+ * reported is the part of suppressed the worker has already announced.
+ */
+typedef struct page_fault_log {
+	unsigned long head;
+	unsigned long tail;
+	unsigned long suppressed;
+	unsigned long reported;
+	u64 window_start;
+	unsigned int window_count;
+	char text[PROBE_LOG_SLOTS][PROBE_STR_LEN];
+} page_fault_log;
+
+
+/*
+ * Per-CPU counters kept on the record path, constant size however long the trace runs.
+ * Bucket b of a log2 histogram counts values in [2^(b-1), 2^b), bucket 0 counts zero.
+ */
+typedef struct page_fault_stats {
+	u64 latency_hist[PROBE_HIST_BUCKETS];
+	u64 interval_hist[PROBE_HIST_BUCKETS];
+	u64 class_count[PROBE_CLASSES];
+	u64 class_latency[PROBE_CLASSES];
+	u64 hot_evicted;
+	u64 follow_refused;	// children and execs follow_fork could not add, the target table was full
+	page_fault_target *targets;	// PROBE_TARGET_SLOTS, by slot of target_table
+	page_fault_hot *hot;
+	page_fault_heat *heat;
+	page_fault_log *log;
+	long last_time;
+	u64 sampled_out;
+	long sample_last;
+	long window_start;
+	unsigned int window_seen;
+	unsigned int sample_skipped;
+	unsigned int sample_shift;
+	bool sample_kept;
+} page_fault_stats;
+
+
+/* State of a packed record stream, a ring's producer and every reader of it keep one */
+typedef struct page_fault_pack {
+	long time;	// time of the previous record, 0 until a time base has been seen
+	unsigned long vpn;	// page number escaped for the next record, 0 if none
+	unsigned int weight;	// weight bits of the records after the last time base
+	u64 seq;	// seq of the next record, 0 until a sequence escape has been seen
+} page_fault_pack;
+
+
+/* Read position of a file in one ring */
+typedef struct page_fault_cursor {
+	unsigned long tail;
+	page_fault_pack pack;
+} page_fault_cursor;
+
+
+/* Per open file state, the read format is fixed at open time */
+typedef struct page_fault_reader {
+	bool binary;
+	bool block;
+	int cpu;	// ring read by a cpuN file, -1 when "data" merges all of them
+	page_fault_pack out;	// compact records copied to this file are packed again in time order
+	page_fault_cursor cursor[];
+} page_fault_reader;
+
+
+/*
+ * Single producer ring owned by one CPU, only handler_pre running on that CPU writes it.
+ * head counts every record ever stored, the slot is head & ring_mask.
+ * tail is the last consumer position the producer has seen, it is only reloaded when the ring looks full.
+ * pending counts records stored since this CPU last kicked the readers.
+ * With compact set head and tail count words of packed, and sync is where the last time base was forced.
+ * seq is handed to the next fault, stored or not, so readers see every lost record as a gap.
+ */
+typedef struct page_fault_ring {
+	unsigned long head;
+	unsigned long tail;
+	unsigned int pending;
+	page_fault_ring_ctrl *ctrl;
+	page_fault_data *data;
+	u64 *packed;
+	page_fault_pack pack;
+	unsigned long sync;
+	u64 seq;
+} ____cacheline_aligned_in_smp page_fault_ring;
+
+
 static char symbol[MAX_SYMBOL_LEN] = "handle_mm_fault";
-static page_fault_data page_fault_data_buffer[PROBE_BUFFER_SIZE];
+static page_fault_ring __percpu *page_fault_rings;
+static page_fault_stats __percpu *page_fault_stats_cpu;
+static page_fault_mmap_info *page_fault_info;
+static DECLARE_WAIT_QUEUE_HEAD(page_fault_wait);
+static struct irq_work page_fault_irq_work;
+
+/*
+ * Traced ids in an open addressed table, 0 marks a free slot and PROBE_TARGET_TOMBSTONE a removed one.
+ * target_filter has the bit of every home slot in use, so one read of a shared word rejects untraced tasks.
+ * target_gen changes each time a slot takes an id, the per-CPU counts of an older one are cleared when next used.
+ */
+static pid_t target_table[PROBE_TARGET_SLOTS];
+static DECLARE_BITMAP(target_filter, PROBE_TARGET_SLOTS);
+static unsigned int target_gen[PROBE_TARGET_SLOTS];
+static unsigned int target_adds;
+static int nr_targets;
+static DEFINE_SPINLOCK(target_lock);
+static DEFINE_MUTEX(reset_lock);
+static bool faults_resetting;	// set by reset_faults while it clears the counts and rings
+
+/*
+ * Switch behind a static key, while it is off the branch is patched to a jump over the code it guards.
+ * set is raised once the switch is given as a parameter, the compile time default no longer applies.
+ */
+typedef struct probe_switch {
+	struct static_key_false key;
+	bool set;
+} probe_switch;
+
+static probe_switch probe_debug = { .key = STATIC_KEY_FALSE_INIT };
+static probe_switch probe_print = { .key = STATIC_KEY_FALSE_INIT };
+static probe_switch cont_store = { .key = STATIC_KEY_FALSE_INIT };
+
+#define probe_switch_on(sw)	static_branch_unlikely(&(sw).key)
+
+
+static int probe_switch_set(const char *, const struct kernel_param *);
+static int probe_switch_get(char *, const struct kernel_param *);
+
+static const struct kernel_param_ops probe_switch_ops = {
+	.set							= probe_switch_set,
+	.get							= probe_switch_get,
+};
 
 
 module_param(process_id, int, 0);
+module_param_array(pid_list, int, &pid_list_len, 0);
+MODULE_PARM_DESC(pid_list, "Additional comma separated ids to trace, up to 3072");
+module_param(match_tgid, bool, 0);
+MODULE_PARM_DESC(match_tgid, "Match ids against the thread group so every thread of a process is traced (default 1)");
+module_param(follow_fork, bool, 0444);
+MODULE_PARM_DESC(follow_fork, "Trace the children a target forks as targets of their own and drop every target when it exits");
+module_param(latency, bool, 0);
+MODULE_PARM_DESC(latency, "Attach as a kretprobe and record how long each fault took and what it returned");
+module_param(latency_maxactive, int, 0);
+MODULE_PARM_DESC(latency_maxactive, "Faults that can be timed at once, default 4 per CPU and at least 64");
+module_param(store_records, bool, 0644);
+MODULE_PARM_DESC(store_records, "Store every fault in the rings, with 0 only the histograms in /proc/<module>/hist are kept");
+module_param(hot_pages, uint, 0444);
+MODULE_PARM_DESC(hot_pages, "Pages counted per CPU in the hot page map shown in /proc/<module>/hot, 0 disables it");
+module_param(heat_window_ms, uint, 0444);
+MODULE_PARM_DESC(heat_window_ms, "Time shown by /proc/<module>/heat, split into 64 columns, 0 disables it (default 8000)");
+module_param(buffer_size, uint, 0444);
+MODULE_PARM_DESC(buffer_size, "Records kept per CPU, rounded up to a power of two (default 1000, max 16M)");
+module_param(compact, uint, 0444);
+MODULE_PARM_DESC(compact, "Store 8 byte packed records without pid and latency, 2 also keeps the 64 byte line within the page");
+module_param(sample_every, uint, 0644);
+MODULE_PARM_DESC(sample_every, "Record 1 in N faults of each CPU, rounded up to a power of two so every record knows its weight (default 1)");
+module_param(sample_us, uint, 0644);
+MODULE_PARM_DESC(sample_us, "Record at most one fault per CPU in this many usec, 0 disables it");
+module_param(sample_rate, uint, 0644);
+MODULE_PARM_DESC(sample_rate, "Records per second a CPU aims for, above it the 1 in N interval doubles until the rate fits, 0 disables it");
+module_param_cb(probe_debug, &probe_switch_ops, &probe_debug, 0644);
+MODULE_PARM_DESC(probe_debug, "Print additional information, can be switched while loaded (default PROBE_DEBUG)");
+module_param_cb(probe_print, &probe_switch_ops, &probe_print, 0644);
+MODULE_PARM_DESC(probe_print, "Print every traced fault, can be switched while loaded (default PROBE_PRINT)");
+module_param_cb(cont_store, &probe_switch_ops, &cont_store, 0644);
+MODULE_PARM_DESC(cont_store, "Keep recording into a full ring over the oldest records, can be switched while loaded (default CONT_STORE)");
+module_param(print_rate, uint, 0644);
+MODULE_PARM_DESC(print_rate, "Fault path messages a CPU may log per second, the rest are counted and reported as suppressed, 0 for no limit (default 1000)");
 module_param_string(symbol, symbol, sizeof(symbol), 0644);
+module_param_string(attach, attach, sizeof(attach), 0444);
+MODULE_PARM_DESC(attach, "How faults are caught: kprobe on symbol (default), tracepoint on exceptions:page_fault_user/kernel, or ftrace on symbol");
+module_param(read_binary, bool, 0644);
+MODULE_PARM_DESC(read_binary, "Files opened while set read raw page_fault_data records instead of text lines");
+module_param(read_block, bool, 0644);
+MODULE_PARM_DESC(read_block, "Files opened while set block in read until new records arrive instead of returning EXIT_CODE");
+module_param(wakeup_batch, uint, 0644);
+MODULE_PARM_DESC(wakeup_batch, "Records a CPU stores before it wakes blocked readers");
+module_param(wakeup_ms, uint, 0644);
+MODULE_PARM_DESC(wakeup_ms, "Longest time in msec a stored record waits before blocked readers are woken");
+
+
+/* Capture modes that "set <name> <value>" on /proc/<module>/ctl changes, through the ops of their parameter */
+typedef struct probe_mode {
+	const char *name;
+	const struct kernel_param_ops *ops;
+	void *arg;
+} probe_mode;
+
+static const probe_mode probe_modes[] = {
+	{ "store_records",	&param_ops_bool,	&store_records },
+	{ "match_tgid",			&param_ops_bool,	&match_tgid },
+	{ "sample_every",		&param_ops_uint,	&sample_every },
+	{ "sample_us",			&param_ops_uint,	&sample_us },
+	{ "sample_rate",		&param_ops_uint,	&sample_rate },
+	{ "print_rate",			&param_ops_uint,	&print_rate },
+	{ "read_binary",		&param_ops_bool,	&read_binary },
+	{ "read_block",			&param_ops_bool,	&read_block },
+	{ "wakeup_batch",		&param_ops_uint,	&wakeup_batch },
+	{ "wakeup_ms",			&param_ops_uint,	&wakeup_ms },
+	{ "cont_store",			&probe_switch_ops,	&cont_store },
+	{ "probe_print",		&probe_switch_ops,	&probe_print },
+	{ "probe_debug",		&probe_switch_ops,	&probe_debug },
+};
 
 
 /* Function Declarations */
 static int handler_pre(struct kprobe *, struct pt_regs *);
 static void handler_post(struct kprobe *, struct pt_regs *, unsigned long);
 static int handler_fault(struct kprobe *, struct pt_regs *, int);
+static int handler_entry(struct kretprobe_instance *, struct pt_regs *);
+static int handler_ret(struct kretprobe_instance *, struct pt_regs *);
+static void handler_tracepoint(void *, unsigned long, struct pt_regs *, unsigned long);
+#ifdef CONFIG_DYNAMIC_FTRACE_WITH_REGS
+static void handler_ftrace(unsigned long, unsigned long, struct ftrace_ops *, struct pt_regs *);
+#endif
 
 
 static int dev_open(struct inode *, struct file *);
 static int dev_close(struct inode *, struct file *);
+static void release_ring_slots(page_fault_reader *);
 static ssize_t dev_read(struct file *, char *, size_t, loff_t *);
+static loff_t dev_llseek(struct file *, loff_t, int);
+static int dev_mmap(struct file *, struct vm_area_struct *);
+static void dev_vm_open(struct vm_area_struct *);
+static void dev_vm_close(struct vm_area_struct *);
+static unsigned int dev_poll(struct file *, poll_table *);
+static int hist_open(struct inode *, struct file *);
+static int hist_show(struct seq_file *, void *);
+static void hist_print(struct seq_file *, const char *, u64 *);
+static int stats_open(struct inode *, struct file *);
+static int stats_show(struct seq_file *, void *);
+static int hot_open(struct inode *, struct file *);
+static int hot_show(struct seq_file *, void *);
+static page_fault_hot *find_hot_page(page_fault_stats *, unsigned long);
+static void hot_top_insert(page_fault_hot *, size_t *, size_t, page_fault_hot *);
+static int hot_cmp_vpn(const void *, const void *);
+static int heat_open(struct inode *, struct file *);
+static int heat_show(struct seq_file *, void *);
+static int ctl_open(struct inode *, struct file *);
+static int ctl_show(struct seq_file *, void *);
+static ssize_t ctl_write(struct file *, const char __user *, size_t, loff_t *);
 
 
-static void get_fault_info(char *, loff_t *);
+static unsigned long ring_pages(void);
+static void *alloc_ring_area(int);
+static void free_ring_area(void *);
+static unsigned long ring_head(page_fault_ring *);
+static unsigned long ring_first(page_fault_ring *, unsigned long);
+static int target_slot(struct task_struct *);
+static bool is_target(struct task_struct *);
+static page_fault_target *target_counts(page_fault_stats *, int);
+static int add_target(pid_t);
+static int del_target(pid_t);
+static int set_probe_mode(const char *, const char *);
+static void clear_fault_stats(page_fault_stats *);
+static void reset_faults(void);
+static u16 classify_fault(struct vm_area_struct *, unsigned long, unsigned int);
+static long probe_fault(struct vm_area_struct *, unsigned long, unsigned int);
+static void find_fault_tracepoint(struct tracepoint *, void *);
+static int register_fault_tracepoints(void);
+static void unregister_fault_tracepoints(void);
+static void handler_fork(void *, struct task_struct *, struct task_struct *);
+static void handler_exec(void *, struct task_struct *, pid_t, struct linux_binprm *);
+static void handler_exit(void *, struct task_struct *);
+static int register_fork_tracepoints(void);
+static void unregister_fork_tracepoints(void);
+static int register_fault_ftrace(void);
+static void unregister_fault_ftrace(void);
+static unsigned int hist_bucket(u64);
+static int sample_fault(long);
+static void update_fault_stats(page_fault_data *, int);
+static void update_hot_page(page_fault_stats *, page_fault_data *);
+static void update_heat_map(page_fault_heat *, page_fault_data *);
+static bool heat_fits(unsigned long, unsigned int, unsigned long);
+static void heat_widen(page_fault_heat *, unsigned long);
+static void record_fault(page_fault_data *);
+static void store_fault(page_fault_data *);
+static int pack_fault(page_fault_pack *, page_fault_data *, u64 *, bool);
+static int unpack_fault(page_fault_pack *, u64, page_fault_data *);
+static bool ring_next_entry(page_fault_ring *, unsigned long *, unsigned long, page_fault_pack *, page_fault_data *);
+static bool reader_has_cpu(page_fault_reader *, int);
+static int next_fault_entry(page_fault_reader *, page_fault_data *);
+static bool fault_entries_pending(page_fault_reader *);
+static void wake_readers(struct irq_work *);
+static void wake_readers_timeout(struct work_struct *);
+static __printf(1, 2) void probe_log(const char *, ...);
+static void drain_fault_log(void);
+static void flush_fault_log(struct work_struct *);
+static int format_fault_line(char *, page_fault_data *);
+static ssize_t get_fault_info(char __user *, size_t, page_fault_reader *, loff_t *);
+static ssize_t get_fault_records(char __user *, size_t, page_fault_reader *, loff_t *);
+static ssize_t get_packed_records(char __user *, size_t, page_fault_reader *, loff_t *);
+static int alloc_fault_rings(void);
+static void free_fault_rings(void);
+static void probe_switch_default(probe_switch *, bool);
 static void dev_cleanup(void);
 
 
+static DECLARE_DELAYED_WORK(page_fault_wake_work, wake_readers_timeout);
+static DECLARE_DELAYED_WORK(page_fault_log_work, flush_fault_log);
+
+
 static struct kprobe dev_kp = {
 	.symbol_name			= symbol,
 	.pre_handler			= handler_pre,
@@ -76,206 +544,2437 @@ static struct kprobe dev_kp = {
 };
 
 
+static struct kretprobe dev_krp = {
+	.kp.symbol_name		= symbol,
+	.entry_handler		= handler_entry,
+	.handler					= handler_ret,
+	.data_size				= sizeof(page_fault_instance),
+};
+
+#ifdef CONFIG_DYNAMIC_FTRACE_WITH_REGS
+static struct ftrace_ops dev_ftrace_ops = {
+	.func							= handler_ftrace,
+	.flags						= FTRACE_OPS_FL_SAVE_REGS,
+};
+#endif
+
+
+/* Takes a module reference per mapping of the rings, a forked or split vma is one more */
+static const struct vm_operations_struct dev_vm_ops = {
+	.open			= dev_vm_open,
+	.close		= dev_vm_close,
+};
+
+
 static struct file_operations dev_file_op = {
 	.owner		= THIS_MODULE,
 	.open			= dev_open,
 	.read			= dev_read,
+	.llseek		= dev_llseek,
+	.mmap			= dev_mmap,
+	.poll			= dev_poll,
 	.release	= dev_close,
 };
 
 
-/* Pass fault Info based on how many lines already read */
-static void get_fault_info(char *message, loff_t *offset) {
+static struct file_operations dev_hist_op = {
+	.owner		= THIS_MODULE,
+	.open			= hist_open,
+	.read			= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
 
-	int skip_node = (int)(*offset);
 
-	if (skip_node >= PROBE_BUFFER_SIZE) {
-		if (PROBE_DEBUG) {
-			printk(KERN_ALERT "DEV Module: Read All Buffer Entry\n");
+static struct file_operations dev_stats_op = {
+	.owner		= THIS_MODULE,
+	.open			= stats_open,
+	.read			= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+
+static struct file_operations dev_hot_op = {
+	.owner		= THIS_MODULE,
+	.open			= hot_open,
+	.read			= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+
+static struct file_operations dev_ctl_op = {
+	.owner		= THIS_MODULE,
+	.open			= ctl_open,
+	.read			= seq_read,
+	.write		= ctl_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+
+static struct file_operations dev_heat_op = {
+	.owner		= THIS_MODULE,
+	.open			= heat_open,
+	.read			= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+
+/* Pages taken by one ring in the mmap() view, control page included */
+static unsigned long ring_pages(void) {
+	return 1 + PAGE_ALIGN(ring_size * record_size) / PAGE_SIZE;
+}
+
+
+/* Published head of a ring, pairs with the release in record_fault */
+static unsigned long ring_head(page_fault_ring *ring) {
+	return smp_load_acquire(&ring->ctrl->head);
+}
+
+
+/* Oldest position still held by a ring whose producer is at head, nothing before the last reset counts */
+static unsigned long ring_first(page_fault_ring *ring, unsigned long head) {
+	return max_t(unsigned long, head > ring_size ? head - ring_size : 0, smp_load_acquire(&ring->ctrl->start));
+}
+
+
+/* Slot of the task in target_table or -1, untraced tasks usually cost one test of target_filter */
+static int target_slot(struct task_struct *task) {
+
+	pid_t id = match_tgid ? task->tgid : task->pid;
+	unsigned int slot = hash_32(id, PROBE_TARGET_BITS);
+	unsigned int probe;
+	unsigned int idx;
+	pid_t entry;
+
+	if (!test_bit(slot, target_filter)) {
+		return -1;
+	}
+	for (probe = 0; probe < PROBE_TARGET_SLOTS; probe++) {
+		idx = (slot + probe) & (PROBE_TARGET_SLOTS - 1);
+		entry = READ_ONCE(target_table[idx]);
+		if (entry == id) {
+			return idx;
+		}
+		if (entry == 0) {
+			break;
 		}
-		strcpy(message, "EXIT_CODE\n");
 	}
-	else {
-		sprintf(message, "PID = %8d Page Fault at Address 0x%lx at Time %ld\n", process_id, page_fault_data_buffer[skip_node].address, page_fault_data_buffer[skip_node].time);
-		*offset += 1;
+	return -1;
+}
+
+
+/* Fast reject for the fault path */
+static bool is_target(struct task_struct *task) {
+	return target_slot(task) >= 0;
+}
+
+
+/* Counts of the target in slot on this CPU, cleared first when the slot took another id since they were last used */
+static page_fault_target *target_counts(page_fault_stats *stats, int slot) {
+
+	page_fault_target *target = &stats->targets[slot];
+	unsigned int gen = READ_ONCE(target_gen[slot]);
+
+	if (target->gen != gen) {
+		target->faults = 0;
+		target->stored = 0;
+		target->last = 0;
+		WRITE_ONCE(target->gen, gen);
 	}
+	return target;
 }
 
 
-/* file_operations open implementation */
-static int dev_open(struct inode *pinode, struct file *pfile) {
+/* Insert an id in the target table, the entry is published before its filter bit */
+static int add_target(pid_t id) {
 
-	pid_t pid;
-	struct task_struct *task = current;
-	pid = task->pid;
-	probe_open_counter += 1;
-	if (PROBE_PRINT) {
-		printk(KERN_INFO "DEV Module: Process %d has called %s function of Dev Page Fault Driver\n", pid, __FUNCTION__);
+	unsigned int slot = hash_32(id, PROBE_TARGET_BITS);
+	unsigned int probe;
+	unsigned int idx;
+	int free_idx = -1;
+
+	if (id <= 0) {
+		return -EINVAL;
 	}
-	if (PROBE_DEBUG) {
-		printk(KERN_INFO "DEV Module: Device opened %d Times\n", probe_open_counter);
+	spin_lock(&target_lock);
+	// the id may sit past a tombstone, so look up to the first free slot before reusing one
+	for (probe = 0; probe < PROBE_TARGET_SLOTS; probe++) {
+		idx = (slot + probe) & (PROBE_TARGET_SLOTS - 1);
+		if (target_table[idx] == id) {
+			spin_unlock(&target_lock);
+			return 0;
+		}
+		if (target_table[idx] == PROBE_TARGET_TOMBSTONE && free_idx < 0) {
+			free_idx = idx;
+		}
+		if (target_table[idx] == 0) {
+			if (free_idx < 0) {
+				free_idx = idx;
+			}
+			break;
+		}
+	}
+	if (free_idx < 0 || nr_targets >= PROBE_MAX_TARGETS) {
+		spin_unlock(&target_lock);
+		return -ENOSPC;
 	}
+	// the slot may have counted a removed target, a new generation makes each CPU start its counts over
+	target_adds = target_adds + 1 != 0 ? target_adds + 1 : 1;
+	WRITE_ONCE(target_gen[free_idx], target_adds);
+	WRITE_ONCE(target_table[free_idx], id);
+	smp_wmb();
+	set_bit(slot, target_filter);
+	nr_targets += 1;
+	spin_unlock(&target_lock);
 	return 0;
 }
 
 
-/* file_operations close implementation */
-static int dev_close(struct inode *pinode, struct file *pfile) {
+/*
+ * Remove an id from the target table. Its slot becomes a tombstone so ids placed past it are still found,
+ * unless nothing follows it. Ids with the same home slot all sit between it and the next free slot,
+ * so only that run is searched before the filter bit is cleared.
+ */
+static int del_target(pid_t id) {
 
-	pid_t pid;
-	struct task_struct *task = current;
-	pid = task->pid;
-	probe_open_counter -= 1;
-	if (PROBE_PRINT) {
-		printk(KERN_INFO "DEV Module: Process %d has called %s function of Dev Page Fault Driver\n", pid, __FUNCTION__);
+	unsigned int slot = hash_32(id, PROBE_TARGET_BITS);
+	unsigned int probe;
+	unsigned int idx;
+	pid_t entry;
+
+	if (id <= 0) {
+		return -EINVAL;
 	}
-	if (PROBE_DEBUG) {
-		printk(KERN_INFO "DEV Module: Device opened %d Times\n", probe_open_counter);
+	spin_lock(&target_lock);
+	for (probe = 0; probe < PROBE_TARGET_SLOTS; probe++) {
+		idx = (slot + probe) & (PROBE_TARGET_SLOTS - 1);
+		if (target_table[idx] == id || target_table[idx] == 0) {
+			break;
+		}
+	}
+	if (probe == PROBE_TARGET_SLOTS || target_table[idx] != id) {
+		spin_unlock(&target_lock);
+		return -ENOENT;
+	}
+	WRITE_ONCE(target_table[idx], PROBE_TARGET_TOMBSTONE);
+	// a run of tombstones that ends in a free slot ends no probe sequence, free it
+	while (target_table[(idx + 1) & (PROBE_TARGET_SLOTS - 1)] == 0 && target_table[idx] == PROBE_TARGET_TOMBSTONE) {
+		WRITE_ONCE(target_table[idx], 0);
+		idx = (idx - 1) & (PROBE_TARGET_SLOTS - 1);
+	}
+	for (probe = 0; probe < PROBE_TARGET_SLOTS; probe++) {
+		entry = target_table[(slot + probe) & (PROBE_TARGET_SLOTS - 1)];
+		if (entry == 0 || (entry != PROBE_TARGET_TOMBSTONE && hash_32(entry, PROBE_TARGET_BITS) == slot)) {
+			break;
+		}
 	}
+	if (probe == PROBE_TARGET_SLOTS || entry == 0) {
+		clear_bit(slot, target_filter);
+	}
+	nr_targets -= 1;
+	spin_unlock(&target_lock);
 	return 0;
 }
 
 
-/* file_operations read implementation, copy info to user space */
-static ssize_t dev_read(struct file *pfile, char __user *buffer, size_t length, loff_t *offset) {
+/*
+ * Set one of probe_modes from its text value, as writing its file in /sys/module/<module>/parameters would,
+ * under the same lock. match_tgid decides what the ids in target_table are, so it only changes with no targets.
+ */
+static int set_probe_mode(const char *name, const char *value) {
 
-	int errors = 0;
-	char message[PROBE_STR_LEN];
-	int message_len = 0;
-	pid_t pid;
+	struct kernel_param param = { 0 };
+	int errors = -EINVAL;
+	int idx;
 
-	if (PROBE_DEBUG) {
-		printk(KERN_INFO "DEV Module: Process %d has called %s function with Offset %lld\n", pid, __FUNCTION__, *offset);
+	kernel_param_lock(THIS_MODULE);
+	for (idx = 0; idx < ARRAY_SIZE(probe_modes); idx++) {
+		if (strcmp(name, probe_modes[idx].name) != 0) {
+			continue;
+		}
+		param.name = probe_modes[idx].name;
+		param.ops = probe_modes[idx].ops;
+		param.arg = probe_modes[idx].arg;
+		if (param.arg == &match_tgid) {
+			spin_lock(&target_lock);
+			errors = nr_targets != 0 ? -EBUSY : param.ops->set(value, &param);
+			spin_unlock(&target_lock);
+		}
+		else {
+			errors = param.ops->set(value, &param);
+		}
+		break;
 	}
+	kernel_param_unlock(THIS_MODULE);
+	return errors;
+}
 
-	pid = current->pid;
-	get_fault_info(message, offset);
-	message_len = strlen(message);
-	errors = copy_to_user(buffer, message, message_len);
-	if (errors != 0) {
-		printk(KERN_INFO "DEV Module: Failed to Copy Fault Info to Process %d with Offset %lld\n", pid, *offset);
+
+/* Zero the counts and maps of one CPU, the sampling state and the message log are kept */
+static void clear_fault_stats(page_fault_stats *stats) {
+
+	memset(stats->latency_hist, 0, sizeof(stats->latency_hist));
+	memset(stats->interval_hist, 0, sizeof(stats->interval_hist));
+	memset(stats->class_count, 0, sizeof(stats->class_count));
+	memset(stats->class_latency, 0, sizeof(stats->class_latency));
+	stats->hot_evicted = 0;
+	stats->follow_refused = 0;
+	stats->last_time = 0;
+	stats->sampled_out = 0;
+	if (stats->targets != NULL) {
+		memset(stats->targets, 0, PROBE_TARGET_SLOTS * sizeof(page_fault_target));
+	}
+	if (stats->hot != NULL) {
+		memset(stats->hot, 0, hot_size * sizeof(page_fault_hot));
+	}
+	if (stats->heat != NULL) {
+		memset(stats->heat, 0, sizeof(page_fault_heat));
 	}
-	return errors == 0 ? message_len : -EFAULT;
 }
 
 
-/* kprobe pre_handler: called just before the probed instruction is executed */
-static int handler_pre(struct kprobe *p, struct pt_regs *regs) {
-
-	// struct timespec current_time;
-	ktime_t current_time;
+/*
+ * Start over without reloading: every ring drops what it holds and every count goes back to zero.
+ * Readers and mmap consumers skip to the new start of each ring, and a compact ring is asked for a new time base there.
+ * record_fault stays out while faults_resetting is set, so once every CPU has left it the maps and the producer
+ * side of the rings are cleared here in process context. Faults taken in the meantime are not counted.
+ */
+static void reset_faults(void) {
 
-	if (current->pid == process_id) {
+	page_fault_ring *ring;
+	unsigned long head;
+	int cpu;
 
-		#ifdef CONFIG_X86
-			// current_time = current_kernel_time();
-			current_time = ktime_get();
-			if (CONT_STORE) {
-				if(data_buffer_idx == PROBE_BUFFER_SIZE) {
-					data_buffer_idx = 0;
-				}
-				else {
-					page_fault_data_buffer[data_buffer_idx].address = regs->si;
-					// page_fault_data_buffer[data_buffer_idx].time = current_time.tv_nsec;
-					page_fault_data_buffer[data_buffer_idx].time = (long)ktime_to_ns(current_time);
-					data_buffer_idx += 1;
-				}
-			}
-			else {
-				if(data_buffer_idx != PROBE_BUFFER_SIZE) {
-					page_fault_data_buffer[data_buffer_idx].address = regs->si;
-					// page_fault_data_buffer[data_buffer_idx].time = current_time.tv_nsec;
-					page_fault_data_buffer[data_buffer_idx].time = (long)ktime_to_ns(current_time);
-					data_buffer_idx += 1;
-				}
-			}
-			if (PROBE_PRINT) {
-				printk(KERN_INFO "DEV Module: <%s> pre_handler:   pid = %8d, vertual->addr = %lx, time = %ld\n", p->symbol_name, current->pid, regs->si, (long)ktime_to_ns(current_time));
-			}
-		#endif
+	mutex_lock(&reset_lock);
+	WRITE_ONCE(faults_resetting, true);
+	// record_fault runs with interrupts off, a grace period waits out every CPU that may be in it
+	#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 20, 0)
+		synchronize_sched();
+	#else
+		synchronize_rcu();
+	#endif
+	for_each_possible_cpu(cpu) {
+		clear_fault_stats(per_cpu_ptr(page_fault_stats_cpu, cpu));
+		ring = per_cpu_ptr(page_fault_rings, cpu);
+		head = ring_head(ring);
+		WRITE_ONCE(ring->sync, head - PROBE_PACK_SYNC);
+		WRITE_ONCE(ring->ctrl->dropped, 0);
+		WRITE_ONCE(ring->ctrl->overwritten, 0);
+		smp_store_release(&ring->ctrl->start, head);
+		// the slots are free again for a producer without cont_store
+		smp_store_release(&ring->ctrl->tail, head);
+		// a hot page map can take tens of megabytes per CPU
+		cond_resched();
 	}
-	else {
-		if (PROBE_DEBUG) {
-			printk(KERN_INFO "DEV Module: Process %d has called %s function of Dev Page Fault Driver\n", current->pid, __FUNCTION__);
+	// the cleared state is complete before any CPU records again
+	smp_store_release(&faults_resetting, false);
+	mutex_unlock(&reset_lock);
+}
+
+
+/* Class bits of a fault from the handle_mm_fault(vma, address, flags) arguments */
+static u16 classify_fault(struct vm_area_struct *vma, unsigned long address, unsigned int fault_flags) {
+
+	u16 flags = 0;
+
+	#ifdef CONFIG_X86
+		if (fault_flags & FAULT_FLAG_WRITE) {
+			flags |= PROBE_REC_WRITE;
+		}
+		if (fault_flags & FAULT_FLAG_USER) {
+			flags |= PROBE_REC_USER;
+		}
+		// the vma is stable here, the faulting task holds mmap_sem, the tracepoint has none
+		if (vma != NULL && vma->vm_file != NULL) {
+			flags |= PROBE_REC_FILE;
 		}
+	#endif
+	return flags;
+}
+
+
+static unsigned int hist_bucket(u64 value) {
+	return min_t(unsigned int, fls64(value), PROBE_HIST_BUCKETS - 1);
+}
+
+
+/*
+ * Record path shared by every attach backend, called for target tasks with preemption off.
+ * Returns the time stamped on the record, or 0 when sampling passed over the fault.
+ */
+static long probe_fault(struct vm_area_struct *vma, unsigned long address, unsigned int fault_flags) {
+
+	page_fault_data fault = { 0 };
+	int weight;
+
+	fault.time = (long)ktime_to_ns(ktime_get());
+	weight = sample_fault(fault.time);
+	if (weight < 0) {
+		return 0;
 	}
-	/* A dump_stack() here will give a stack backtrace */
-	return 0;
+	fault.address = address;
+	fault.flags = classify_fault(vma, address, fault_flags) | weight << PROBE_REC_WEIGHT_SHIFT;
+	record_fault(&fault);
+	return fault.time;
 }
 
 
-/* kprobe post_handler: called after the probed instruction is executed */
-static void handler_post(struct kprobe *p, struct pt_regs *regs, unsigned long flags) {
+/*
+ * Decide whether the fault about to be recorded on this CPU is kept, before anything else is spent on it.
+ * Returns log2 of the faults the kept record stands for, or -1 when sampling passes over it.
+ * A CPU keeps 1 in 1 << sample_shift faults and with sample_us at most one per interval.
+ * With sample_rate the shift follows the fault rate, one power of two per window and never below sample_every.
+ */
+static int sample_fault(long now) {
 
-	if (current->pid == process_id) {
-		#ifdef CONFIG_X86
-			if (PROBE_PRINT) {
-				printk(KERN_INFO "DEV Module: <%s> post_handler:  pid = %8d, vertual->addr = %lx, flags = 0x%lx\n", p->symbol_name, current->pid, regs->si, regs->flags);
-			}
-		#endif
+	page_fault_stats *stats = this_cpu_ptr(page_fault_stats_cpu);
+	unsigned int base = sample_every > 1 ? min_t(unsigned int, order_base_2(sample_every), PROBE_SAMPLE_MAX_SHIFT) : 0;
+	unsigned int limit;
+	unsigned int weight;
+
+	stats->sample_kept = 1;
+	if (base == 0 && !sample_us && !sample_rate) {
+		return 0;
+	}
+	if (!sample_rate) {
+		stats->sample_shift = base;
 	}
 	else {
-		if (PROBE_DEBUG) {
-			printk(KERN_INFO "DEV Module: Process %d has called %s function of Dev Page Fault Driver\n", current->pid, __FUNCTION__);
+		if (now - stats->window_start >= PROBE_SAMPLE_WINDOW) {
+			limit = max_t(unsigned int, sample_rate / (NSEC_PER_SEC / PROBE_SAMPLE_WINDOW), 1);
+			if ((stats->window_seen >> stats->sample_shift) > limit && stats->sample_shift < PROBE_SAMPLE_MAX_SHIFT) {
+				stats->sample_shift += 1;
+			}
+			else if ((stats->window_seen >> stats->sample_shift) < limit / 2 && stats->sample_shift > base) {
+				stats->sample_shift -= 1;
+			}
+			stats->sample_shift = max(stats->sample_shift, base);
+			stats->window_start = now;
+			stats->window_seen = 0;
 		}
+		stats->window_seen += 1;
 	}
+	stats->sample_skipped += 1;
+	if (stats->sample_skipped < (1U << stats->sample_shift) || (sample_us && now - stats->sample_last < (long)sample_us * NSEC_PER_USEC)) {
+		stats->sampled_out += 1;
+		stats->sample_kept = 0;
+		return -1;
+	}
+	// exact for 1 in N, sample_us rounds the faults passed over to the nearest power of two
+	weight = stats->sample_skipped;
+	stats->sample_skipped = 0;
+	stats->sample_last = now;
+	return min_t(int, ilog2(weight + (weight >> 1)), PROBE_SAMPLE_MAX_SHIFT);
 }
 
 
-/* fault_handler: this is called if an exception is generated for any instruction within the pre- or post-handler */
-static int handler_fault(struct kprobe *p, struct pt_regs *regs, int trapnr) {
+/* Fold one fault into this CPU's histograms and the counts of its target slot, the gap is measured from the previous fault seen by this CPU */
+static void update_fault_stats(page_fault_data *fault, int slot) {
 
-	if (current->pid == process_id) {
-		#ifdef CONFIG_X86
-			if (PROBE_PRINT) {
-				printk(KERN_ALERT "DEV Module: <%s> fault_handler: pid = %8d, vertual->addr = %lx, trap #%dn\n", p->symbol_name, current->pid, regs->si, trapnr);
-			}
-		#endif
+	page_fault_stats *stats = this_cpu_ptr(page_fault_stats_cpu);
+	page_fault_target *target;
+	unsigned int class = (fault->flags >> PROBE_REC_CLASS_SHIFT) & (PROBE_CLASSES - 1);
+	u64 weight = 1ULL << ((fault->flags >> PROBE_REC_WEIGHT_SHIFT) & PROBE_REC_WEIGHT_MASK);
+
+	// counts are scaled by the sampling weight, intervals are between recorded faults
+	stats->class_count[class] += weight;
+	if (fault->flags & PROBE_REC_LATENCY) {
+		stats->latency_hist[hist_bucket(fault->latency)] += weight;
+		stats->class_latency[class] += fault->latency * weight;
 	}
-	else {
-		if (PROBE_DEBUG) {
-			printk(KERN_INFO "DEV Module: Process %d has called %s function of Dev Page Fault Driver\n", current->pid, __FUNCTION__);
+	if (slot >= 0) {
+		target = target_counts(stats, slot);
+		target->faults += weight;
+		target->last = fault->time;
+	}
+	if (stats->last_time != 0 && fault->time >= stats->last_time) {
+		stats->interval_hist[hist_bucket(fault->time - stats->last_time)] += 1;
+	}
+	stats->last_time = fault->time;
+	if (stats->hot != NULL) {
+		update_hot_page(stats, fault);
+	}
+	if (stats->heat != NULL) {
+		update_heat_map(stats->heat, fault);
+	}
+}
+
+
+/*
+ * Count a fault against its page in this CPU's hot page map. When the page is not present and
+ * every slot it can use is taken, the slot with the fewest faults is given to it.
+ */
+static void update_hot_page(page_fault_stats *stats, page_fault_data *fault) {
+
+	unsigned long vpn = fault->address >> PAGE_SHIFT;
+	unsigned long slot = hash_long(vpn, ilog2(hot_size));
+	page_fault_hot *victim = NULL;
+	page_fault_hot *hot;
+	int probe;
+
+	for (probe = 0; probe < PROBE_HOT_PROBE; probe++) {
+		hot = &stats->hot[(slot + probe) & (hot_size - 1)];
+		if (hot->count != 0 && hot->vpn == vpn) {
+			hot->count += 1U << ((fault->flags >> PROBE_REC_WEIGHT_SHIFT) & PROBE_REC_WEIGHT_MASK);
+			hot->last_time = fault->time;
+			return;
+		}
+		if (hot->count == 0) {
+			victim = hot;
+			break;
+		}
+		if (victim == NULL || hot->count < victim->count) {
+			victim = hot;
 		}
 	}
-	/* Return 0 because we don't handle the fault. */
-	return 0;
+	if (victim->count != 0) {
+		stats->hot_evicted += 1;
+	}
+	victim->vpn = vpn;
+	victim->count = 1U << ((fault->flags >> PROBE_REC_WEIGHT_SHIFT) & PROBE_REC_WEIGHT_MASK);
+	victim->first_time = fault->time;
+	victim->last_time = fault->time;
 }
 
 
-static void dev_cleanup(void) {
+/* Count a fault in its cell, O(1) unless the rows have to be widened for it */
+static void update_heat_map(page_fault_heat *heat, page_fault_data *fault) {
 
-	if (dev_file_entry != NULL) {
-		remove_proc_entry(PROBE_NAME,NULL);
-		printk(KERN_INFO "DEV Module: Removed File Entry : /proc/%s\n", PROBE_NAME);
+	u64 slot = (u64)fault->time >> heat_col_shift;
+	unsigned int col = slot & (PROBE_HEAT_COLS - 1);
+
+	if (heat->row_shift == 0) {
+		heat->row_shift = PAGE_SHIFT;
+		heat->base = fault->address & ~(((unsigned long)PROBE_HEAT_ROWS << PAGE_SHIFT) - 1);
+	}
+	if (!heat_fits(heat->base, heat->row_shift, fault->address)) {
+		heat_widen(heat, fault->address);
 	}
+	if (heat->slot[col] != slot) {
+		if (heat->slot[col] > slot) {
+			// the column already counts a later slot, this fault has left the window
+			return;
+		}
+		memset(heat->cells[col], 0, sizeof(heat->cells[col]));
+		heat->slot[col] = slot;
+	}
+	heat->cells[col][(fault->address - heat->base) >> heat->row_shift] += 1U << ((fault->flags >> PROBE_REC_WEIGHT_SHIFT) & PROBE_REC_WEIGHT_MASK);
+}
 
-	if (probe_ret >= 0) {
-		unregister_kprobe(&dev_kp);
-		printk(KERN_ALERT "DEV Module: Probe at %p Unregistered\n", dev_kp.addr);
+
+static bool heat_fits(unsigned long base, unsigned int row_shift, unsigned long address) {
+	return address >= base && (address - base) >> row_shift < PROBE_HEAT_ROWS;
+}
+
+
+/* Double the row size until both the current rows and address fit, folding the counts into the new rows */
+static void heat_widen(page_fault_heat *heat, unsigned long address) {
+
+	u32 folded[PROBE_HEAT_ROWS];
+	unsigned long last = heat->base + ((unsigned long)(PROBE_HEAT_ROWS - 1) << heat->row_shift);
+	unsigned long base;
+	unsigned int row_shift = heat->row_shift;
+	int col;
+	int row;
+
+	do {
+		row_shift += 1;
+		base = min(heat->base, address) & ~((1UL << row_shift) - 1);
+	} while (!heat_fits(base, row_shift, address) || !heat_fits(base, row_shift, last));
+
+	for (col = 0; col < PROBE_HEAT_COLS; col++) {
+		memset(folded, 0, sizeof(folded));
+		for (row = 0; row < PROBE_HEAT_ROWS; row++) {
+			folded[(heat->base + ((unsigned long)row << heat->row_shift) - base) >> row_shift] += heat->cells[col][row];
+		}
+		memcpy(heat->cells[col], folded, sizeof(folded));
 	}
+	heat->base = base;
+	heat->row_shift = row_shift;
 }
 
 
-static int __init pf_probe_init(void) {
+/*
+ * Count and store one fault, caller runs with preemption disabled and fills everything but the ids.
+ * Interrupts are kept off on the way, so nothing on this CPU gets in between and reset_faults can wait it out.
+ */
+static void record_fault(page_fault_data *fault) {
 
-	dev_file_entry = proc_create(PROBE_NAME, 0, NULL, &dev_file_op);
-	if (dev_file_entry == NULL) {
-		printk(KERN_ALERT "DEV Module: Failed to Create File Entry for %s\n", PROBE_NAME);
-		return -EFAULT;
+	unsigned long irq_flags;
+
+	local_irq_save(irq_flags);
+	if (!smp_load_acquire(&faults_resetting)) {
+		store_fault(fault);
 	}
-	else {
-		printk(KERN_INFO "DEV Module: Created File Entry : /proc/%s, for User Space Program\n", PROBE_NAME);
+	local_irq_restore(irq_flags);
+}
+
+
+/* Fold one fault into this CPU's counts and store it in this CPU's ring, interrupts are off */
+static void store_fault(page_fault_data *fault) {
+
+	page_fault_ring *ring = this_cpu_ptr(page_fault_rings);
+	unsigned long head = ring->head;
+	page_fault_pack pack = ring->pack;
+	page_fault_data *entry;
+	u64 words[PROBE_PACK_MAX_WORDS];
+	int count = 1;
+	int idx;
+	int slot = target_slot(current);
+	bool forced = false;
+
+	update_fault_stats(fault, slot);
+	if (!store_records) {
+		return;
 	}
 
-	probe_ret = register_kprobe(&dev_kp);
-	if (probe_ret < 0) {
-		printk(KERN_ALERT "DEV Module: Register Probe Failed Return Code %d\n", probe_ret);
-		dev_cleanup();
+	fault->seq = ring->seq++;
+	if (compact) {
+		// packed on a copy of the stream state, a fault that is not stored leaves it untouched
+		forced = head - ring->sync >= PROBE_PACK_SYNC;
+		if (forced) {
+			pack.time = 0;
+		}
+		count = pack_fault(&pack, fault, words, true);
+	}
+	if (head + count - ring->tail > ring_size) {
+		// looks full, check whether a consumer has freed slots since
+		ring->tail = smp_load_acquire(&ring->ctrl->tail);
+		if (head + count - ring->tail > ring_size) {
+			if (!probe_switch_on(cont_store)) {
+				WRITE_ONCE(ring->ctrl->dropped, ring->ctrl->dropped + 1);
+				return;
+			}
+			// flight recorder, the oldest slots go whether or not they were consumed
+			WRITE_ONCE(ring->ctrl->overwritten, ring->ctrl->overwritten + head + count - ring->tail - ring_size);
+			ring->tail = head + count - ring_size;
+		}
+	}
+	if (compact) {
+		if (forced) {
+			ring->sync = head;
+		}
+		ring->pack = pack;
+		for (idx = 0; idx < count; idx++) {
+			ring->packed[(head + idx) & ring_mask] = words[idx];
+		}
+	}
+	else {
+		entry = &ring->data[head & ring_mask];
+		*entry = *fault;
+		entry->pid = current->pid;
+		entry->tgid = current->tgid;
+	}
+	if (slot >= 0) {
+		target_counts(this_cpu_ptr(page_fault_stats_cpu), slot)->stored += 1;
+	}
+	ring->head = head + count;
+	// make the entry visible before the new head
+	smp_store_release(&ring->ctrl->head, ring->head);
+
+	// wake readers once per batch, the wait queue lock is never taken here
+	ring->pending += 1;
+	if (ring->pending >= wakeup_batch) {
+		ring->pending = 0;
+		irq_work_queue(&page_fault_irq_work);
+	}
+}
+
+
+/*
+ * Pack a fault into at most three words at out against the stream state in pack, returns the words used.
+ * A time base escape comes first when the delta does not fit and a page number escape when the page does not.
+ */
+static int pack_fault(page_fault_pack *pack, page_fault_data *fault, u64 *out, bool seq) {
+
+	unsigned int delta_bits = compact == 2 ? PROBE_PACK_DELTA_BITS - PROBE_PACK_LINE_BITS : PROBE_PACK_DELTA_BITS;
+	unsigned long vpn = fault->address >> PAGE_SHIFT;
+	u64 delta = (u64)(fault->time - pack->time);
+	unsigned int weight = (fault->flags >> PROBE_REC_WEIGHT_SHIFT) & PROBE_REC_WEIGHT_MASK;
+	u64 word;
+	int count = 0;
+
+	if (pack->time == 0 || fault->time < pack->time || delta >> delta_bits || weight != pack->weight) {
+		out[count++] = PROBE_PACK_ESCAPE | (u64)weight << PROBE_PACK_TIME_BITS | ((u64)fault->time & ((1ULL << PROBE_PACK_TIME_BITS) - 1));
+		pack->weight = weight;
+		delta = 0;
+		// a reader that lost its place picks the seq up again with the time base
+		pack->seq = 0;
+	}
+	if (seq && fault->seq != pack->seq) {
+		out[count++] = PROBE_PACK_ESCAPE | PROBE_PACK_VPN | PROBE_PACK_SEQ | (fault->seq & (PROBE_PACK_SEQ - 1));
+	}
+	pack->seq = seq ? fault->seq + 1 : 0;
+	if (vpn >> PROBE_PACK_VPN_BITS) {
+		out[count++] = PROBE_PACK_ESCAPE | PROBE_PACK_VPN | vpn;
+		vpn = 0;
+	}
+	word = (u64)vpn << PROBE_PACK_VPN_SHIFT | delta << PROBE_PACK_DELTA_SHIFT | ((fault->flags >> 1) & ((1 << PROBE_PACK_FLAG_BITS) - 1));
+	if (compact == 2) {
+		word |= (u64)((fault->address >> (PAGE_SHIFT - PROBE_PACK_LINE_BITS)) & ((1 << PROBE_PACK_LINE_BITS) - 1)) << (PROBE_PACK_VPN_SHIFT - PROBE_PACK_LINE_BITS);
+	}
+	out[count++] = word;
+	pack->time = fault->time;
+	return count;
+}
+
+
+/* Apply one packed word to the stream state, returns 1 when it completed a fault in entry */
+static int unpack_fault(page_fault_pack *pack, u64 word, page_fault_data *entry) {
+
+	unsigned int delta_bits = compact == 2 ? PROBE_PACK_DELTA_BITS - PROBE_PACK_LINE_BITS : PROBE_PACK_DELTA_BITS;
+	unsigned long vpn;
+
+	if (word & PROBE_PACK_ESCAPE) {
+		if ((word & PROBE_PACK_VPN) && (word & PROBE_PACK_SEQ)) {
+			pack->seq = word & (PROBE_PACK_SEQ - 1);
+		}
+		else if (word & PROBE_PACK_VPN) {
+			pack->vpn = word & PROBE_PACK_PAYLOAD;
+		}
+		else {
+			pack->time = word & ((1ULL << PROBE_PACK_TIME_BITS) - 1);
+			pack->weight = (word & PROBE_PACK_PAYLOAD) >> PROBE_PACK_TIME_BITS;
+		}
+		return 0;
+	}
+	if (pack->time == 0) {
+		// the time base of this record was overwritten, wait for the next one
+		pack->vpn = 0;
+		return 0;
+	}
+	vpn = pack->vpn != 0 ? pack->vpn : word >> PROBE_PACK_VPN_SHIFT;
+	pack->vpn = 0;
+	pack->time += (word >> PROBE_PACK_DELTA_SHIFT) & ((1ULL << delta_bits) - 1);
+	memset(entry, 0, sizeof(page_fault_data));
+	entry->address = vpn << PAGE_SHIFT;
+	if (compact == 2) {
+		entry->address |= ((word >> (PROBE_PACK_VPN_SHIFT - PROBE_PACK_LINE_BITS)) & ((1 << PROBE_PACK_LINE_BITS) - 1)) << (PAGE_SHIFT - PROBE_PACK_LINE_BITS);
+	}
+	entry->time = pack->time;
+	entry->flags = (word & ((1 << PROBE_PACK_FLAG_BITS) - 1)) << 1 | pack->weight << PROBE_REC_WEIGHT_SHIFT;
+	entry->seq = pack->seq;
+	if (pack->seq != 0) {
+		pack->seq += 1;
+	}
+	return 1;
+}
+
+
+/*
+ * Next fault of a ring from *pos up to head in either record format, pack is only used with compact.
+ * A slot is copied first and checked after, like a seqlock read: if the producer has come round to it
+ * meanwhile the copy is thrown away and the reader starts over at the oldest slot it can still trust.
+ */
+static bool ring_next_entry(page_fault_ring *ring, unsigned long *pos, unsigned long head, page_fault_pack *pack, page_fault_data *entry) {
+
+	// the producer may be writing this many slots past the head it has published
+	unsigned long margin = compact ? PROBE_PACK_MAX_WORDS : 1;
+	unsigned long now;
+	page_fault_data copy;
+	u64 word = 0;
+
+	while (*pos < head) {
+		if (!compact) {
+			copy = ring->data[*pos & ring_mask];
+		}
+		else {
+			word = READ_ONCE(ring->packed[*pos & ring_mask]);
+		}
+		// the copy is done before head is read again
+		smp_rmb();
+		now = READ_ONCE(ring->ctrl->head);
+		if (*pos + ring_size < now + margin) {
+			*pos = max_t(unsigned long, ring_first(ring, now), now + margin - ring_size);
+			memset(pack, 0, sizeof(page_fault_pack));
+			continue;
+		}
+		*pos += 1;
+		if (!compact) {
+			*entry = copy;
+			return true;
+		}
+		if (unpack_fault(pack, word, entry)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+/* irq_work callback, runs outside the probe once a CPU has stored a full batch */
+static void wake_readers(struct irq_work *work) {
+	wake_up_interruptible(&page_fault_wait);
+}
+
+
+/* Periodic kick so records from a batch that never fills still reach blocked readers */
+static void wake_readers_timeout(struct work_struct *work) {
+	if (waitqueue_active(&page_fault_wait)) {
+		wake_up_interruptible(&page_fault_wait);
+	}
+	schedule_delayed_work(&page_fault_wake_work, msecs_to_jiffies(max(wakeup_ms, 1U)));
+}
+
+
+/*
+ * printk for the fault path: format into this CPU's log and leave the console to flush_fault_log.
+ * Over print_rate messages a second, or with the log full, the message is only counted.
+ */
+static void probe_log(const char *fmt, ...) {
+
+	page_fault_log *log = get_cpu_ptr(page_fault_stats_cpu)->log;
+	u64 now = local_clock();
+	va_list args;
+
+	if (log == NULL) {
+		put_cpu_ptr(page_fault_stats_cpu);
+		return;
+	}
+	if (now - log->window_start >= NSEC_PER_SEC) {
+		log->window_start = now;
+		log->window_count = 0;
+	}
+	if ((print_rate != 0 && log->window_count >= print_rate) || log->head - smp_load_acquire(&log->tail) >= PROBE_LOG_SLOTS) {
+		WRITE_ONCE(log->suppressed, log->suppressed + 1);
+		put_cpu_ptr(page_fault_stats_cpu);
+		return;
+	}
+	log->window_count += 1;
+	va_start(args, fmt);
+	vsnprintf(log->text[log->head & (PROBE_LOG_SLOTS - 1)], PROBE_STR_LEN, fmt, args);
+	va_end(args);
+	// the text must be complete before the worker sees the new head
+	smp_store_release(&log->head, log->head + 1);
+	put_cpu_ptr(page_fault_stats_cpu);
+}
+
+
+/* Print up to a batch of logged messages of every CPU, and how many were suppressed since the last flush */
+static void drain_fault_log(void) {
+
+	page_fault_log *log;
+	unsigned long head;
+	unsigned long suppressed;
+	int printed;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		log = per_cpu_ptr(page_fault_stats_cpu, cpu)->log;
+		if (log == NULL) {
+			continue;
+		}
+		head = smp_load_acquire(&log->head);
+		for (printed = 0; log->tail != head && printed < PROBE_LOG_BATCH; printed++) {
+			printk("%s", log->text[log->tail & (PROBE_LOG_SLOTS - 1)]);
+			smp_store_release(&log->tail, log->tail + 1);
+		}
+		suppressed = READ_ONCE(log->suppressed);
+		if (suppressed != log->reported) {
+			printk(KERN_INFO "DEV Module: Suppressed %lu Messages on CPU %d\n", suppressed - log->reported, cpu);
+			log->reported = suppressed;
+		}
+	}
+}
+
+
+/* Periodic flush of the fault path messages, printk and the console lock are only taken here */
+static void flush_fault_log(struct work_struct *work) {
+	drain_fault_log();
+	schedule_delayed_work(&page_fault_log_work, msecs_to_jiffies(PROBE_LOG_FLUSH_MS));
+}
+
+
+/* True if the file reads the ring of cpu */
+static bool reader_has_cpu(page_fault_reader *reader, int cpu) {
+	return reader->cpu < 0 || reader->cpu == cpu;
+}
+
+
+/* Merge the rings of this file, hand out the oldest unread entry and advance that CPU's cursor */
+static int next_fault_entry(page_fault_reader *reader, page_fault_data *entry) {
+
+	page_fault_cursor *cursor = reader->cursor;
+	page_fault_ring *ring;
+	page_fault_data next;
+	page_fault_pack pack;
+	page_fault_pack best_pack = { 0 };
+	unsigned long head;
+	unsigned long pos;
+	unsigned long best_pos = 0;
+	int best_cpu = -1;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (!reader_has_cpu(reader, cpu)) {
+			continue;
+		}
+		ring = per_cpu_ptr(page_fault_rings, cpu);
+		head = ring_head(ring);
+		if (cursor[cpu].tail < ring_first(ring, head)) {
+			// producer lapped this reader or a reset dropped its records, skip what is gone
+			cursor[cpu].tail = ring_first(ring, head);
+			cursor[cpu].pack.time = 0;
+			cursor[cpu].pack.seq = 0;
+		}
+		pos = cursor[cpu].tail;
+		pack = cursor[cpu].pack;
+		if (!ring_next_entry(ring, &pos, head, &pack, &next)) {
+			// nothing but escapes was left, they are consumed
+			cursor[cpu].tail = pos;
+			cursor[cpu].pack = pack;
+			continue;
+		}
+		if (best_cpu < 0 || next.time < entry->time) {
+			*entry = next;
+			best_cpu = cpu;
+			best_pos = pos;
+			best_pack = pack;
+		}
+	}
+	if (best_cpu >= 0) {
+		cursor[best_cpu].tail = best_pos;
+		cursor[best_cpu].pack = best_pack;
+	}
+	return best_cpu;
+}
+
+
+/* True if any ring holds a record this reader has not consumed yet */
+static bool fault_entries_pending(page_fault_reader *reader) {
+
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (reader_has_cpu(reader, cpu) && ring_head(per_cpu_ptr(page_fault_rings, cpu)) != reader->cursor[cpu].tail) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+/* Format one fault as a text line, returns its length */
+static int format_fault_line(char *message, page_fault_data *entry) {
+
+	if (entry->flags & PROBE_REC_LATENCY) {
+		return scnprintf(message, PROBE_LINE_LEN, "PID = %8d Page Fault at Address 0x%lx at Time %ld Flags 0x%x Cpu %llu Seq %llu Latency %u Ret 0x%x\n", entry->pid, entry->address, entry->time, entry->flags,
+			entry->seq >> PROBE_SEQ_CPU_SHIFT, entry->seq & ((1ULL << PROBE_SEQ_CPU_SHIFT) - 1), entry->latency, entry->ret);
+	}
+	return scnprintf(message, PROBE_LINE_LEN, "PID = %8d Page Fault at Address 0x%lx at Time %ld Flags 0x%x Cpu %llu Seq %llu\n", entry->pid, entry->address, entry->time, entry->flags,
+		entry->seq >> PROBE_SEQ_CPU_SHIFT, entry->seq & ((1ULL << PROBE_SEQ_CPU_SHIFT) - 1));
+}
+
+
+/*
+ * Pass fault Info in time order, cursor holds the per-CPU read positions of this file.
+ * Copies as many lines as fit in the user buffer, "EXIT_CODE" only when nothing new was stored since the last read,
+ * or 0 for a blocking reader so dev_read waits again.
+ */
+static ssize_t get_fault_info(char __user *buffer, size_t length, page_fault_reader *reader, loff_t *offset) {
+
+	page_fault_data entry;
+	char message[PROBE_LINE_LEN];
+	size_t copied = 0;
+	int message_len;
+
+	if (length < PROBE_LINE_LEN) {
+		return -EINVAL;
+	}
+	// a fault is only taken while the longest line still fits, so none is consumed without being copied
+	while (copied + PROBE_LINE_LEN <= length && next_fault_entry(reader, &entry) >= 0) {
+		message_len = format_fault_line(message, &entry);
+		if (copy_to_user(buffer + copied, message, message_len) != 0) {
+			return -EFAULT;
+		}
+		copied += message_len;
+		*offset += 1;
+	}
+	if (copied == 0 && !reader->block) {
+		if (probe_switch_on(probe_debug)) {
+			printk(KERN_ALERT "DEV Module: Read All Buffer Entry\n");
+		}
+		message_len = strlen("EXIT_CODE\n");
+		if (copy_to_user(buffer, "EXIT_CODE\n", message_len) != 0) {
+			return -EFAULT;
+		}
+		copied = message_len;
+	}
+	return copied;
+}
+
+
+/* Copy as many whole records as fit in the user buffer, 0 once every ring is drained */
+static ssize_t get_fault_records(char __user *buffer, size_t length, page_fault_reader *reader, loff_t *offset) {
+
+	page_fault_data batch[PROBE_READ_BATCH];
+	size_t max_count = length / sizeof(page_fault_data);
+	size_t count = 0;
+	int batch_len;
+
+	while (count < max_count) {
+		for (batch_len = 0; batch_len < PROBE_READ_BATCH && count + batch_len < max_count; batch_len++) {
+			if (next_fault_entry(reader, &batch[batch_len]) < 0) {
+				break;
+			}
+		}
+		if (batch_len == 0) {
+			break;
+		}
+		if (copy_to_user(buffer + count * sizeof(page_fault_data), batch, batch_len * sizeof(page_fault_data)) != 0) {
+			return -EFAULT;
+		}
+		count += batch_len;
+		*offset += batch_len;
+	}
+	return count * sizeof(page_fault_data);
+}
+
+
+/* With compact set, copy the merged faults packed again against this file's own stream state, 0 once drained */
+static ssize_t get_packed_records(char __user *buffer, size_t length, page_fault_reader *reader, loff_t *offset) {
+
+	u64 batch[PROBE_READ_BATCH * PROBE_PACK_MAX_WORDS];
+	page_fault_data entry;
+	size_t max_count = length / sizeof(u64);
+	size_t count = 0;
+	int batch_len;
+
+	while (count + PROBE_PACK_MAX_WORDS <= max_count) {
+		// leave room for the worst case of a fault
+		for (batch_len = 0; batch_len + PROBE_PACK_MAX_WORDS <= PROBE_READ_BATCH * PROBE_PACK_MAX_WORDS && count + batch_len + PROBE_PACK_MAX_WORDS <= max_count; ) {
+			if (next_fault_entry(reader, &entry) < 0) {
+				break;
+			}
+			// the merged stream of "data" jumps between CPUs, so only a cpuN file keeps seq
+			batch_len += pack_fault(&reader->out, &entry, &batch[batch_len], reader->cpu >= 0);
+			*offset += 1;
+		}
+		if (batch_len == 0) {
+			break;
+		}
+		if (copy_to_user(buffer + count * sizeof(u64), batch, batch_len * sizeof(u64)) != 0) {
+			return -EFAULT;
+		}
+		count += batch_len;
+	}
+	return count * sizeof(u64);
+}
+
+
+/* file_operations open implementation */
+static int dev_open(struct inode *pinode, struct file *pfile) {
+
+	page_fault_reader *reader;
+	pid_t pid;
+	struct task_struct *task = current;
+	pid = task->pid;
+	reader = kzalloc(sizeof(page_fault_reader) + nr_cpu_ids * sizeof(page_fault_cursor), GFP_KERNEL);
+	if (reader == NULL) {
+		printk(KERN_ALERT "DEV Module: Failed to Allocate Read Cursor for Process %d\n", pid);
+		return -ENOMEM;
+	}
+	reader->binary = READ_ONCE(read_binary);
+	reader->block = READ_ONCE(read_block);
+	// cpuN files carry cpu + 1, "data" carries nothing
+	reader->cpu = (long)PDE_DATA(pinode) - 1;
+	pfile->private_data = reader;
+	probe_open_counter += 1;
+	if (probe_switch_on(probe_print)) {
+		printk(KERN_INFO "DEV Module: Process %d has called %s function of Dev Page Fault Driver\n", pid, __FUNCTION__);
+	}
+	if (probe_switch_on(probe_debug)) {
+		printk(KERN_INFO "DEV Module: Device opened %d Times\n", probe_open_counter);
+	}
+	return 0;
+}
+
+
+/* file_operations close implementation */
+static int dev_close(struct inode *pinode, struct file *pfile) {
+
+	pid_t pid;
+	struct task_struct *task = current;
+	pid = task->pid;
+	kfree(pfile->private_data);
+	probe_open_counter -= 1;
+	if (probe_switch_on(probe_print)) {
+		printk(KERN_INFO "DEV Module: Process %d has called %s function of Dev Page Fault Driver\n", pid, __FUNCTION__);
+	}
+	if (probe_switch_on(probe_debug)) {
+		printk(KERN_INFO "DEV Module: Device opened %d Times\n", probe_open_counter);
+	}
+	return 0;
+}
+
+
+/* file_operations read implementation, copy info to user space */
+/*
+ * Hand the slots a read() cursor has passed back to the producer. Without cont_store a ring only stops
+ * once it is full of records no consumer has read, with several readers it is held for the one furthest ahead.
+ */
+static void release_ring_slots(page_fault_reader *reader) {
+
+	page_fault_ring *ring;
+	unsigned long pos;
+	unsigned long tail;
+	unsigned long seen;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (!reader_has_cpu(reader, cpu)) {
+			continue;
+		}
+		ring = per_cpu_ptr(page_fault_rings, cpu);
+		pos = reader->cursor[cpu].tail;
+		tail = READ_ONCE(ring->ctrl->tail);
+		// cmpxchg orders the copies out of the slots before the producer sees them free
+		while (tail < pos) {
+			seen = cmpxchg(&ring->ctrl->tail, tail, pos);
+			if (seen == tail) {
+				break;
+			}
+			tail = seen;
+		}
+	}
+}
+
+
+static ssize_t dev_read(struct file *pfile, char __user *buffer, size_t length, loff_t *offset) {
+
+	page_fault_reader *reader = pfile->private_data;
+	ssize_t copied;
+	pid_t pid = current->pid;
+
+	if (probe_switch_on(probe_debug)) {
+		printk(KERN_INFO "DEV Module: Process %d has called %s function with Offset %lld\n", pid, __FUNCTION__, *offset);
+	}
+
+	// a blocking read that could never take a record would wait forever
+	if (reader->block && reader->binary && length < (compact ? PROBE_PACK_MAX_WORDS * sizeof(u64) : sizeof(page_fault_data))) {
+		return -EINVAL;
+	}
+	// escape and sync words, or a cursor left before a reset start, wake the wait without a record, so wait again
+	while (1) {
+		if (reader->block && !fault_entries_pending(reader)) {
+			if (pfile->f_flags & O_NONBLOCK) {
+				return -EAGAIN;
+			}
+			if (wait_event_interruptible(page_fault_wait, fault_entries_pending(reader))) {
+				return -ERESTARTSYS;
+			}
+		}
+		if (reader->binary) {
+			copied = compact ? get_packed_records(buffer, length, reader, offset) : get_fault_records(buffer, length, reader, offset);
+			if (copied < 0) {
+				printk(KERN_INFO "DEV Module: Failed to Copy Fault Records to Process %d with Offset %lld\n", pid, *offset);
+			}
+		}
+		else {
+			copied = get_fault_info(buffer, length, reader, offset);
+			if (copied == -EFAULT) {
+				printk(KERN_INFO "DEV Module: Failed to Copy Fault Info to Process %d with Offset %lld\n", pid, *offset);
+			}
+		}
+		release_ring_slots(reader);
+		if (copied != 0 || !reader->block) {
+			return copied;
+		}
+	}
+}
+
+
+/*
+ * file_operations llseek implementation, moves every cursor of this file at once.
+ * SEEK_SET 0 rewinds to the oldest record still held, SEEK_END 0 skips everything stored so far,
+ * SEEK_CUR 0 tells how many records were read since open or the last seek.
+ */
+static loff_t dev_llseek(struct file *pfile, loff_t offset, int whence) {
+
+	page_fault_reader *reader = pfile->private_data;
+	page_fault_ring *ring;
+	unsigned long head;
+	int cpu;
+
+	if (offset != 0 || (whence != SEEK_SET && whence != SEEK_CUR && whence != SEEK_END)) {
+		return -EINVAL;
+	}
+	if (whence == SEEK_CUR) {
+		return pfile->f_pos;
+	}
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(page_fault_rings, cpu);
+		head = ring_head(ring);
+		// with compact set the stream state is dropped, faults are handed out again from the next time base
+		reader->cursor[cpu].tail = whence == SEEK_SET ? ring_first(ring, head) : head;
+		memset(&reader->cursor[cpu].pack, 0, sizeof(page_fault_pack));
+	}
+	memset(&reader->out, 0, sizeof(page_fault_pack));
+	pfile->f_pos = 0;
+	if (whence == SEEK_END) {
+		release_ring_slots(reader);
+	}
+	return 0;
+}
+
+
+/* file_operations mmap implementation, maps the info page and every ring in place */
+static int dev_mmap(struct file *pfile, struct vm_area_struct *vma) {
+
+	page_fault_ring *ring;
+	unsigned long uaddr;
+	unsigned long page;
+	int errors;
+	int cpu;
+
+	if (vma->vm_pgoff != 0 || !(vma->vm_flags & VM_SHARED)) {
+		return -EINVAL;
+	}
+	if (vma->vm_end - vma->vm_start > (1 + nr_cpu_ids * ring_pages()) * PAGE_SIZE) {
+		return -EINVAL;
+	}
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_ops = &dev_vm_ops;
+
+	errors = vm_insert_page(vma, vma->vm_start, virt_to_page(page_fault_info));
+	if (errors != 0) {
+		return errors;
+	}
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(page_fault_rings, cpu);
+		for (page = 0; page < ring_pages(); page++) {
+			uaddr = vma->vm_start + (1 + cpu * ring_pages() + page) * PAGE_SIZE;
+			if (uaddr >= vma->vm_end) {
+				dev_vm_open(vma);
+				return 0;
+			}
+			if (is_vmalloc_addr(ring->ctrl)) {
+				errors = vm_insert_page(vma, uaddr, vmalloc_to_page((char *)ring->ctrl + page * PAGE_SIZE));
+			}
+			else {
+				errors = vm_insert_page(vma, uaddr, virt_to_page((char *)ring->ctrl + page * PAGE_SIZE));
+			}
+			if (errors != 0) {
+				printk(KERN_INFO "DEV Module: Failed to Map Ring of CPU %d for Process %d\n", cpu, current->pid);
+				return errors;
+			}
+		}
+	}
+	dev_vm_open(vma);
+	return 0;
+}
+
+
+/*
+ * A new mapping of the rings, from dev_mmap or a copy of one. Each mapping holds the module,
+ * the vma calls dev_vm_close and maps the rings after its file is closed.
+ */
+static void dev_vm_open(struct vm_area_struct *vma) {
+	__module_get(THIS_MODULE);
+}
+
+
+static void dev_vm_close(struct vm_area_struct *vma) {
+	module_put(THIS_MODULE);
+}
+
+
+/* file_operations poll implementation, readable while this file has unread records */
+static unsigned int dev_poll(struct file *pfile, poll_table *wait) {
+
+	page_fault_reader *reader = pfile->private_data;
+
+	poll_wait(pfile, &page_fault_wait, wait);
+	if (fault_entries_pending(reader)) {
+		return POLLIN | POLLRDNORM;
+	}
+	return 0;
+}
+
+
+static int hist_open(struct inode *pinode, struct file *pfile) {
+	return single_open(pfile, hist_show, NULL);
+}
+
+
+/* Print one folded histogram, only the buckets between the first and last non empty one */
+static void hist_print(struct seq_file *m, const char *title, u64 *hist) {
+
+	u64 max_count = 0;
+	u64 total = 0;
+	int first = -1;
+	int last = -1;
+	int bar;
+	int idx;
+
+	for (idx = 0; idx < PROBE_HIST_BUCKETS; idx++) {
+		if (hist[idx] != 0) {
+			if (first < 0) {
+				first = idx;
+			}
+			last = idx;
+			total += hist[idx];
+			max_count = max(max_count, hist[idx]);
+		}
+	}
+	seq_printf(m, "%s, %llu samples\n", title, total);
+	for (idx = first; first >= 0 && idx <= last; idx++) {
+		bar = (int)div64_u64(hist[idx] * PROBE_HIST_WIDTH, max_count);
+		seq_printf(m, "[%20llu, %20llu) %12llu |%-*.*s|\n", idx == 0 ? 0ULL : 1ULL << (idx - 1), 1ULL << idx, hist[idx], PROBE_HIST_WIDTH, bar, "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@");
+	}
+	seq_putc(m, '\n');
+}
+
+
+/* seq_file show of /proc/<module>/hist, sums the per-CPU histograms at read time */
+static int hist_show(struct seq_file *m, void *v) {
+
+	page_fault_stats *stats;
+	u64 *latency_hist;
+	u64 *interval_hist;
+	int cpu;
+	int idx;
+
+	latency_hist = kcalloc(2 * PROBE_HIST_BUCKETS, sizeof(u64), GFP_KERNEL);
+	if (latency_hist == NULL) {
+		return -ENOMEM;
+	}
+	interval_hist = latency_hist + PROBE_HIST_BUCKETS;
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(page_fault_stats_cpu, cpu);
+		for (idx = 0; idx < PROBE_HIST_BUCKETS; idx++) {
+			latency_hist[idx] += READ_ONCE(stats->latency_hist[idx]);
+			interval_hist[idx] += READ_ONCE(stats->interval_hist[idx]);
+		}
+	}
+	hist_print(m, "Fault latency in nsec (latency=1 only)", latency_hist);
+	hist_print(m, "Time between faults on the same CPU in nsec", interval_hist);
+	kfree(latency_hist);
+	return 0;
+}
+
+
+static int stats_open(struct inode *pinode, struct file *pfile) {
+	return single_open(pfile, stats_show, NULL);
+}
+
+
+/* seq_file show of /proc/<module>/stats, fault counts per class summed over every CPU */
+static int stats_show(struct seq_file *m, void *v) {
+
+	page_fault_stats *stats;
+	u64 count[PROBE_CLASSES] = { 0 };
+	u64 total_latency[PROBE_CLASSES] = { 0 };
+	u64 split[4][2] = { { 0 } };
+	u64 sampled_out = 0;
+	u64 follow_refused = 0;
+	u64 dropped = 0;
+	u64 overwritten = 0;
+	unsigned int sample_shift = 0;
+	page_fault_ring_ctrl *ctrl;
+	u16 flags;
+	int class;
+	int cpu;
+	int bit;
+
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(page_fault_stats_cpu, cpu);
+		for (class = 0; class < PROBE_CLASSES; class++) {
+			count[class] += READ_ONCE(stats->class_count[class]);
+			total_latency[class] += READ_ONCE(stats->class_latency[class]);
+		}
+		sampled_out += READ_ONCE(stats->sampled_out);
+		follow_refused += READ_ONCE(stats->follow_refused);
+		sample_shift = max(sample_shift, READ_ONCE(stats->sample_shift));
+		ctrl = per_cpu_ptr(page_fault_rings, cpu)->ctrl;
+		dropped += READ_ONCE(ctrl->dropped);
+		overwritten += READ_ONCE(ctrl->overwritten);
+	}
+	for (class = 0; class < PROBE_CLASSES; class++) {
+		for (bit = 0; bit < 4; bit++) {
+			split[bit][(class >> bit) & 1] += count[class];
+		}
+	}
+	seq_printf(m, "read %llu write %llu\n", split[0][0], split[0][1]);
+	seq_printf(m, "kernel %llu user %llu\n", split[1][0], split[1][1]);
+	seq_printf(m, "anon %llu file %llu\n", split[2][0], split[2][1]);
+	if (latency) {
+		seq_printf(m, "minor %llu major %llu\n", split[3][0], split[3][1]);
+	}
+	else {
+		seq_printf(m, "minor/major unknown, load with latency=1\n");
+	}
+	seq_printf(m, "records: dropped %llu, overwritten %llu%s\n", dropped, overwritten, compact ? " words" : "");
+	for_each_possible_cpu(cpu) {
+		ctrl = per_cpu_ptr(page_fault_rings, cpu)->ctrl;
+		if (READ_ONCE(ctrl->dropped) != 0 || READ_ONCE(ctrl->overwritten) != 0) {
+			seq_printf(m, "  cpu %d: dropped %llu, overwritten %llu\n", cpu, READ_ONCE(ctrl->dropped), READ_ONCE(ctrl->overwritten));
+		}
+	}
+	if (sampled_out != 0) {
+		seq_printf(m, "sampled: %llu faults passed over, widest interval 1 in %u, counts are scaled by record weight\n", sampled_out, 1U << sample_shift);
+	}
+	if (follow_refused != 0) {
+		seq_printf(m, "follow_fork: %llu tasks not traced, the table of %d targets was full\n", follow_refused, PROBE_MAX_TARGETS);
+	}
+
+	seq_printf(m, "\n%-6s %-7s %-5s %-6s %14s %16s\n", "access", "mode", "map", "type", "faults", "avg latency ns");
+	for (class = 0; class < PROBE_CLASSES; class++) {
+		if (count[class] == 0) {
+			continue;
+		}
+		flags = class << PROBE_REC_CLASS_SHIFT;
+		seq_printf(m, "%-6s %-7s %-5s %-6s %14llu %16llu\n",
+			flags & PROBE_REC_WRITE ? "write" : "read",
+			flags & PROBE_REC_USER ? "user" : "kernel",
+			flags & PROBE_REC_FILE ? "file" : "anon",
+			!latency ? "-" : flags & PROBE_REC_MAJOR ? "major" : "minor",
+			count[class], latency ? div64_u64(total_latency[class], count[class]) : 0ULL);
+	}
+	return 0;
+}
+
+
+static int hot_open(struct inode *pinode, struct file *pfile) {
+	return single_open(pfile, hot_show, NULL);
+}
+
+
+/* Slot of a page in one CPU's hot page map or NULL, the probe sequence of update_hot_page */
+static page_fault_hot *find_hot_page(page_fault_stats *stats, unsigned long vpn) {
+
+	unsigned long slot = hash_long(vpn, ilog2(hot_size));
+	page_fault_hot *hot;
+	int probe;
+
+	for (probe = 0; probe < PROBE_HOT_PROBE; probe++) {
+		hot = &stats->hot[(slot + probe) & (hot_size - 1)];
+		if (READ_ONCE(hot->count) == 0) {
+			return NULL;
+		}
+		if (hot->vpn == vpn) {
+			return hot;
+		}
+	}
+	return NULL;
+}
+
+
+/* Keep the limit pages with the most faults seen so far in top, most first */
+static void hot_top_insert(page_fault_hot *top, size_t *nr_top, size_t limit, page_fault_hot *page) {
+
+	size_t idx;
+
+	if (*nr_top < limit) {
+		idx = (*nr_top)++;
+	}
+	else if (page->count > top[limit - 1].count) {
+		idx = limit - 1;
+	}
+	else {
+		return;
+	}
+	for (; idx > 0 && top[idx - 1].count < page->count; idx--) {
+		top[idx] = top[idx - 1];
+	}
+	top[idx] = *page;
+}
+
+
+/* sort() order of hot pages by virtual page number */
+static int hot_cmp_vpn(const void *a, const void *b) {
+
+	unsigned long vpn_a = ((const page_fault_hot *)a)->vpn;
+	unsigned long vpn_b = ((const page_fault_hot *)b)->vpn;
+
+	return vpn_a < vpn_b ? -1 : vpn_a > vpn_b;
+}
+
+
+/*
+ * seq_file show of /proc/<module>/hot, lists the pages that faulted most over all CPUs.
+ * Each CPU first gives its PROBE_HOT_CANDIDATES hottest pages and only those are summed over
+ * all maps by hash, so a read is one pass per map instead of a lookup per slot and CPU.
+ * A page spread thinly over many CPUs without being hot on any of them can be missed.
+ */
+static int hot_show(struct seq_file *m, void *v) {
+
+	page_fault_stats *stats;
+	page_fault_hot *candidates;
+	page_fault_hot *top;
+	page_fault_hot *hot;
+	page_fault_hot page;
+	u64 evicted = 0;
+	size_t nr_slots = 0;
+	size_t nr_candidates = 0;
+	size_t nr_cpu_top;
+	size_t nr_top = 0;
+	size_t idx;
+	int cpu;
+
+	if (hot_size == 0) {
+		seq_printf(m, "hot page map disabled, load with hot_pages=<pages per CPU>\n");
+		return 0;
+	}
+	candidates = vmalloc((size_t)nr_cpu_ids * PROBE_HOT_CANDIDATES * sizeof(page_fault_hot));
+	if (candidates == NULL) {
+		return -ENOMEM;
+	}
+	top = kmalloc_array(PROBE_HOT_TOP, sizeof(page_fault_hot), GFP_KERNEL);
+	if (top == NULL) {
+		vfree(candidates);
+		return -ENOMEM;
+	}
+
+	// one pass per map keeps the hottest pages of each CPU
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(page_fault_stats_cpu, cpu);
+		evicted += READ_ONCE(stats->hot_evicted);
+		nr_cpu_top = 0;
+		for (idx = 0; idx < hot_size; idx++) {
+			if (READ_ONCE(stats->hot[idx].count) == 0) {
+				continue;
+			}
+			page = stats->hot[idx];
+			nr_slots += 1;
+			hot_top_insert(candidates + nr_candidates, &nr_cpu_top, PROBE_HOT_CANDIDATES, &page);
+		}
+		nr_candidates += nr_cpu_top;
+		cond_resched();
+	}
+
+	// a page hot on several CPUs is summed once, with the counts of every map that holds it
+	sort(candidates, nr_candidates, sizeof(page_fault_hot), hot_cmp_vpn, NULL);
+	for (idx = 0; idx < nr_candidates; idx++) {
+		if (idx > 0 && candidates[idx].vpn == candidates[idx - 1].vpn) {
+			continue;
+		}
+		page = candidates[idx];
+		page.count = 0;
+		for_each_possible_cpu(cpu) {
+			hot = find_hot_page(per_cpu_ptr(page_fault_stats_cpu, cpu), page.vpn);
+			if (hot == NULL) {
+				continue;
+			}
+			page.count += hot->count;
+			page.first_time = min(page.first_time, hot->first_time);
+			page.last_time = max(page.last_time, hot->last_time);
+		}
+		hot_top_insert(top, &nr_top, PROBE_HOT_TOP, &page);
+		cond_resched();
+	}
+
+	seq_printf(m, "%zu slots used, %llu evicted\n", nr_slots, evicted);
+	seq_printf(m, "%18s %14s %20s %20s\n", "address", "faults", "first time", "last time");
+	for (idx = 0; idx < nr_top; idx++) {
+		seq_printf(m, "%#18lx %14llu %20ld %20ld\n", top[idx].vpn << PAGE_SHIFT, top[idx].count, top[idx].first_time, top[idx].last_time);
+	}
+	kfree(top);
+	vfree(candidates);
+	return 0;
+}
+
+
+static int heat_open(struct inode *pinode, struct file *pfile) {
+	return single_open_size(pfile, heat_show, NULL, (PROBE_HEAT_ROWS + 8) * (PROBE_HEAT_COLS + 32));
+}
+
+
+/*
+ * seq_file show of /proc/<module>/heat, merges the per-CPU cell counters into one grid of the last
+ * PROBE_HEAT_COLS time slots, newest on the right, drawn with a log2 ramp of characters.
+ * Costs O(cells) per read whatever the number of records.
+ */
+static int heat_show(struct seq_file *m, void *v) {
+
+	static const char ramp[] = " .:-=+*#%@";
+	page_fault_heat *heat;
+	u32 *grid;
+	u32 count;
+	u32 max_count = 0;
+	u64 now;
+	u64 slot;
+	unsigned long cpu_base;
+	unsigned long address;
+	unsigned long low = ULONG_MAX;
+	unsigned long high = 0;
+	unsigned long base = 0;
+	unsigned int cpu_shift;
+	unsigned int row_shift = 0;
+	int levels;
+	int col;
+	int row;
+	int cpu;
+
+	if (heat_window_ms == 0) {
+		seq_printf(m, "heatmap disabled, load with heat_window_ms=<msec>\n");
+		return 0;
+	}
+	// rows wide enough for the rows of every CPU, they are powers of two so each CPU row lands in one of them
+	for_each_possible_cpu(cpu) {
+		heat = per_cpu_ptr(page_fault_stats_cpu, cpu)->heat;
+		cpu_shift = READ_ONCE(heat->row_shift);
+		if (cpu_shift == 0) {
+			continue;
+		}
+		cpu_base = READ_ONCE(heat->base);
+		low = min(low, cpu_base);
+		high = max(high, cpu_base + ((unsigned long)(PROBE_HEAT_ROWS - 1) << cpu_shift));
+		row_shift = max(row_shift, cpu_shift);
+	}
+	if (row_shift == 0) {
+		seq_printf(m, "No Page Fault Recorded for pid = %8d\n", process_id);
+		return 0;
+	}
+	base = low & ~((1UL << row_shift) - 1);
+	while (!heat_fits(base, row_shift, high)) {
+		row_shift += 1;
+		base = low & ~((1UL << row_shift) - 1);
+	}
+
+	grid = kcalloc(PROBE_HEAT_COLS * PROBE_HEAT_ROWS, sizeof(u32), GFP_KERNEL);
+	if (grid == NULL) {
+		return -ENOMEM;
+	}
+	now = (u64)ktime_to_ns(ktime_get()) >> heat_col_shift;
+	for_each_possible_cpu(cpu) {
+		heat = per_cpu_ptr(page_fault_stats_cpu, cpu)->heat;
+		cpu_shift = READ_ONCE(heat->row_shift);
+		cpu_base = READ_ONCE(heat->base);
+		if (cpu_shift == 0) {
+			continue;
+		}
+		for (col = 0; col < PROBE_HEAT_COLS; col++) {
+			slot = READ_ONCE(heat->slot[col]);
+			if (slot > now || now - slot >= PROBE_HEAT_COLS) {
+				continue;
+			}
+			for (row = 0; row < PROBE_HEAT_ROWS; row++) {
+				count = READ_ONCE(heat->cells[col][row]);
+				address = cpu_base + ((unsigned long)row << cpu_shift);
+				// a CPU can widen its rows while they are read, drop what no longer lines up
+				if (count == 0 || !heat_fits(base, row_shift, address)) {
+					continue;
+				}
+				grid[(PROBE_HEAT_COLS - 1 - (now - slot)) * PROBE_HEAT_ROWS + ((address - base) >> row_shift)] += count;
+			}
+		}
+	}
+	for (col = 0; col < PROBE_HEAT_COLS * PROBE_HEAT_ROWS; col++) {
+		max_count = max(max_count, grid[col]);
+	}
+	levels = max(fls(max_count) - 1, 1);
+
+	seq_printf(m, "rows of %lu bytes from %#lx, columns of %llu usec, newest on the right\n", 1UL << row_shift, base, (1ULL << heat_col_shift) / NSEC_PER_USEC);
+	seq_printf(m, "'%s' from 1 to %u faults per cell, each step doubles\n", ramp + 1, max_count);
+	for (row = PROBE_HEAT_ROWS - 1; row >= 0; row--) {
+		seq_printf(m, "%#18lx | ", base + ((unsigned long)row << row_shift));
+		for (col = 0; col < PROBE_HEAT_COLS; col++) {
+			count = grid[col * PROBE_HEAT_ROWS + row];
+			seq_putc(m, count == 0 ? ramp[0] : ramp[1 + (fls(count) - 1) * (sizeof(ramp) - 3) / levels]);
+		}
+		seq_putc(m, '\n');
+	}
+	kfree(grid);
+	return 0;
+}
+
+
+/* kprobe pre_handler: called just before the probed instruction is executed */
+static int handler_pre(struct kprobe *p, struct pt_regs *regs) {
+
+	long time;
+
+	if (is_target(current)) {
+
+		#ifdef CONFIG_X86
+			// handle_mm_fault(vma, address, flags)
+			time = probe_fault((struct vm_area_struct *)regs->di, regs->si, (unsigned int)regs->dx);
+			if (probe_switch_on(probe_print) && time != 0) {
+				probe_log(KERN_INFO "DEV Module: <%s> pre_handler:   pid = %8d, vertual->addr = %lx, time = %ld\n", p->symbol_name, current->pid, regs->si, time);
+			}
+		#endif
+	}
+	else {
+		if (probe_switch_on(probe_debug)) {
+			probe_log(KERN_INFO "DEV Module: Process %d has called %s function of Dev Page Fault Driver\n", current->pid, __FUNCTION__);
+		}
+	}
+	/* A dump_stack() here will give a stack backtrace */
+	return 0;
+}
+
+
+/* kprobe post_handler: called after the probed instruction is executed */
+static void handler_post(struct kprobe *p, struct pt_regs *regs, unsigned long flags) {
+
+	if (is_target(current)) {
+		if (!this_cpu_ptr(page_fault_stats_cpu)->sample_kept) {
+			// handler_pre passed over this fault
+			return;
+		}
+		#ifdef CONFIG_X86
+			if (probe_switch_on(probe_print)) {
+				probe_log(KERN_INFO "DEV Module: <%s> post_handler:  pid = %8d, vertual->addr = %lx, flags = 0x%lx\n", p->symbol_name, current->pid, regs->si, regs->flags);
+			}
+		#endif
+	}
+	else {
+		if (probe_switch_on(probe_debug)) {
+			probe_log(KERN_INFO "DEV Module: Process %d has called %s function of Dev Page Fault Driver\n", current->pid, __FUNCTION__);
+		}
+	}
+}
+
+
+/*
+ * fault_handler: this is called if an exception is generated for any instruction within the pre- or post-handler.
+ * It keeps calling printk directly, the exception may have been raised inside probe_log.
+ */
+static int handler_fault(struct kprobe *p, struct pt_regs *regs, int trapnr) {
+
+	if (is_target(current)) {
+		#ifdef CONFIG_X86
+			if (probe_switch_on(probe_print)) {
+				printk(KERN_ALERT "DEV Module: <%s> fault_handler: pid = %8d, vertual->addr = %lx, trap #%dn\n", p->symbol_name, current->pid, regs->si, trapnr);
+			}
+		#endif
+	}
+	else {
+		if (probe_switch_on(probe_debug)) {
+			printk(KERN_INFO "DEV Module: Process %d has called %s function of Dev Page Fault Driver\n", current->pid, __FUNCTION__);
+		}
+	}
+	/* Return 0 because we don't handle the fault. */
+	return 0;
+}
+
+
+/* kretprobe entry_handler: remember address and entry time, non target tasks are not armed for return */
+static int handler_entry(struct kretprobe_instance *ri, struct pt_regs *regs) {
+
+	page_fault_instance *instance = (page_fault_instance *)ri->data;
+	int weight;
+
+	if (!is_target(current)) {
+		return 1;
+	}
+	#ifdef CONFIG_X86
+		instance->time = ktime_get();
+		weight = sample_fault((long)ktime_to_ns(instance->time));
+		if (weight < 0) {
+			// not timed, handler_ret is skipped for this fault
+			return 1;
+		}
+		instance->address = regs->si;
+		instance->flags = classify_fault((struct vm_area_struct *)regs->di, regs->si, (unsigned int)regs->dx) | weight << PROBE_REC_WEIGHT_SHIFT;
+		return 0;
+	#else
+		return 1;
+	#endif
+}
+
+
+/* kretprobe handler: the probed function returned, record the fault with its service time and VM_FAULT_* result */
+static int handler_ret(struct kretprobe_instance *ri, struct pt_regs *regs) {
+
+	page_fault_instance *instance = (page_fault_instance *)ri->data;
+	page_fault_data fault = { 0 };
+	s64 delta = ktime_to_ns(ktime_sub(ktime_get(), instance->time));
+
+	fault.address = instance->address;
+	fault.time = (long)ktime_to_ns(instance->time);
+	fault.latency = (u32)min_t(s64, delta, U32_MAX);
+	fault.ret = (u16)regs_return_value(regs);
+	fault.flags = instance->flags | PROBE_REC_LATENCY;
+	if (fault.ret & VM_FAULT_MAJOR) {
+		fault.flags |= PROBE_REC_MAJOR;
+	}
+	record_fault(&fault);
+	if (probe_switch_on(probe_print)) {
+		probe_log(KERN_INFO "DEV Module: <%s> ret_handler:   pid = %8d, vertual->addr = %lx, latency = %u ns, ret = 0x%x\n", symbol, current->pid, fault.address, fault.latency, fault.ret);
+	}
+	return 0;
+}
+
+
+/*
+ * exceptions:page_fault_user and page_fault_kernel, data is the tracepoint name.
+ * They fire in the exception handler before mmap_sem is taken, so there is no vma and file backed faults are not told apart.
+ */
+static void handler_tracepoint(void *data, unsigned long address, struct pt_regs *regs, unsigned long error_code) {
+
+	unsigned int fault_flags = 0;
+	long time;
+
+	if (!is_target(current)) {
+		return;
+	}
+	if (error_code & PROBE_PF_WRITE) {
+		fault_flags |= FAULT_FLAG_WRITE;
+	}
+	if (error_code & PROBE_PF_USER) {
+		fault_flags |= FAULT_FLAG_USER;
+	}
+	time = probe_fault(NULL, address, fault_flags);
+	if (probe_switch_on(probe_print) && time != 0) {
+		probe_log(KERN_INFO "DEV Module: <%s> tracepoint:    pid = %8d, vertual->addr = %lx, time = %ld\n", (const char *)data, current->pid, address, time);
+	}
+}
+
+
+#ifdef CONFIG_DYNAMIC_FTRACE_WITH_REGS
+/* ftrace callback at the entry of symbol, a call from the function prologue instead of a breakpoint trap */
+static void notrace handler_ftrace(unsigned long ip, unsigned long parent_ip, struct ftrace_ops *ops, struct pt_regs *regs) {
+
+	long time;
+
+	if (regs == NULL || !is_target(current)) {
+		return;
+	}
+	#ifdef CONFIG_X86
+		// the ring and stats are per CPU, kprobes and tracepoints already run with preemption off
+		preempt_disable_notrace();
+		time = probe_fault((struct vm_area_struct *)regs->di, regs->si, (unsigned int)regs->dx);
+		preempt_enable_notrace();
+		if (probe_switch_on(probe_print) && time != 0) {
+			probe_log(KERN_INFO "DEV Module: <%s> ftrace:        pid = %8d, vertual->addr = %lx, time = %ld\n", symbol, current->pid, regs->si, time);
+		}
+	#endif
+}
+#endif
+
+
+/* for_each_kernel_tracepoint callback, tracepoints are not exported by name to modules */
+static void find_fault_tracepoint(struct tracepoint *tp, void *priv) {
+
+	int idx;
+
+	for (idx = 0; idx < PROBE_TRACEPOINTS; idx++) {
+		if (strcmp(tp->name, fault_tracepoint_names[idx]) == 0) {
+			fault_tracepoints[idx] = tp;
+		}
+	}
+	for (idx = 0; idx < PROBE_FORK_TRACEPOINTS; idx++) {
+		if (strcmp(tp->name, fork_tracepoint_names[idx]) == 0) {
+			fork_tracepoints[idx] = tp;
+		}
+	}
+}
+
+
+static int register_fault_tracepoints(void) {
+
+	int errors = 0;
+	int idx;
+
+	for_each_kernel_tracepoint(find_fault_tracepoint, NULL);
+	for (idx = 0; idx < PROBE_TRACEPOINTS; idx++) {
+		if (fault_tracepoints[idx] == NULL) {
+			printk(KERN_ALERT "DEV Module: Tracepoint %s Not Found, use attach=kprobe\n", fault_tracepoint_names[idx]);
+			errors = -ENOENT;
+			break;
+		}
+		errors = tracepoint_probe_register(fault_tracepoints[idx], handler_tracepoint, (void *)fault_tracepoint_names[idx]);
+		if (errors < 0) {
+			break;
+		}
+		fault_tracepoint_on[idx] = 1;
+	}
+	if (errors < 0) {
+		unregister_fault_tracepoints();
+	}
+	return errors;
+}
+
+
+static void unregister_fault_tracepoints(void) {
+
+	int idx;
+
+	for (idx = 0; idx < PROBE_TRACEPOINTS; idx++) {
+		if (fault_tracepoint_on[idx]) {
+			tracepoint_probe_unregister(fault_tracepoints[idx], handler_tracepoint, (void *)fault_tracepoint_names[idx]);
+			fault_tracepoint_on[idx] = 0;
+		}
+	}
+	// no handler may still be running when the rings are freed
+	tracepoint_synchronize_unregister();
+}
+
+
+/*
+ * sched_process_fork: runs before the child is first woken, so a child of a target is traced from its first fault.
+ * With match_tgid a new thread shares the id of its process and is already traced.
+ */
+static void handler_fork(void *data, struct task_struct *parent, struct task_struct *child) {
+
+	pid_t id = match_tgid ? child->tgid : child->pid;
+
+	if (target_slot(parent) < 0 || target_slot(child) >= 0) {
+		return;
+	}
+	if (add_target(id) < 0) {
+		this_cpu_ptr(page_fault_stats_cpu)->follow_refused += 1;
+		probe_log(KERN_INFO "DEV Module: Target Table Full, Child %d of %d Not Traced\n", id, parent->pid);
+		return;
+	}
+	if (probe_switch_on(probe_debug)) {
+		probe_log(KERN_INFO "DEV Module: Following Child %d of %d\n", id, parent->pid);
+	}
+}
+
+
+/* sched_process_exec: a thread that calls exec takes over the pid of its group leader, which only matters without match_tgid */
+static void handler_exec(void *data, struct task_struct *task, pid_t old_pid, struct linux_binprm *bprm) {
+
+	if (match_tgid || old_pid == task->pid || del_target(old_pid) < 0) {
+		return;
+	}
+	if (add_target(task->pid) < 0) {
+		this_cpu_ptr(page_fault_stats_cpu)->follow_refused += 1;
+		probe_log(KERN_INFO "DEV Module: Target Table Full, %d Not Traced after Exec\n", task->pid);
+	}
+}
+
+
+/* sched_process_exit: the id is dropped so it can be reused by an untraced task, with match_tgid once the last thread exits */
+static void handler_exit(void *data, struct task_struct *task) {
+
+	if (target_slot(task) < 0) {
+		return;
+	}
+	if (match_tgid && atomic_read(&task->signal->live) != 0) {
+		return;
+	}
+	del_target(match_tgid ? task->tgid : task->pid);
+	if (probe_switch_on(probe_debug)) {
+		probe_log(KERN_INFO "DEV Module: Target %d Exited\n", match_tgid ? task->tgid : task->pid);
+	}
+}
+
+
+static int register_fork_tracepoints(void) {
+
+	void *handlers[PROBE_FORK_TRACEPOINTS] = { handler_fork, handler_exec, handler_exit };
+	int errors = 0;
+	int idx;
+
+	for_each_kernel_tracepoint(find_fault_tracepoint, NULL);
+	for (idx = 0; idx < PROBE_FORK_TRACEPOINTS; idx++) {
+		if (fork_tracepoints[idx] == NULL) {
+			printk(KERN_ALERT "DEV Module: Tracepoint %s Not Found, load without follow_fork\n", fork_tracepoint_names[idx]);
+			errors = -ENOENT;
+			break;
+		}
+		errors = tracepoint_probe_register(fork_tracepoints[idx], handlers[idx], NULL);
+		if (errors < 0) {
+			break;
+		}
+		fork_tracepoint_on[idx] = 1;
+	}
+	if (errors < 0) {
+		unregister_fork_tracepoints();
+	}
+	return errors;
+}
+
+
+static void unregister_fork_tracepoints(void) {
+
+	void *handlers[PROBE_FORK_TRACEPOINTS] = { handler_fork, handler_exec, handler_exit };
+	int idx;
+
+	for (idx = 0; idx < PROBE_FORK_TRACEPOINTS; idx++) {
+		if (fork_tracepoint_on[idx]) {
+			tracepoint_probe_unregister(fork_tracepoints[idx], handlers[idx], NULL);
+			fork_tracepoint_on[idx] = 0;
+		}
+	}
+	tracepoint_synchronize_unregister();
+}
+
+
+static int register_fault_ftrace(void) {
+
+	#ifdef CONFIG_DYNAMIC_FTRACE_WITH_REGS
+		int errors;
+
+		errors = ftrace_set_filter(&dev_ftrace_ops, (unsigned char *)symbol, strlen(symbol), 0);
+		if (errors == 0) {
+			errors = register_ftrace_function(&dev_ftrace_ops);
+		}
+		if (errors < 0) {
+			ftrace_free_filter(&dev_ftrace_ops);
+		}
+		return errors;
+	#else
+		return -ENODEV;
+	#endif
+}
+
+
+static void unregister_fault_ftrace(void) {
+
+	#ifdef CONFIG_DYNAMIC_FTRACE_WITH_REGS
+		unregister_ftrace_function(&dev_ftrace_ops);
+		ftrace_free_filter(&dev_ftrace_ops);
+	#endif
+}
+
+
+static int ctl_open(struct inode *pinode, struct file *pfile) {
+	return single_open(pfile, ctl_show, NULL);
+}
+
+
+/* seq_file show of /proc/<module>/ctl, the traced ids with what each of them faulted and stored */
+static int ctl_show(struct seq_file *m, void *v) {
+
+	page_fault_target *target;
+	unsigned int gen;
+	u64 faults;
+	u64 stored;
+	long last;
+	pid_t id;
+	int slot;
+	int cpu;
+	int idx;
+
+	seq_printf(m, "targets: %d of %d, matched by %s\n", READ_ONCE(nr_targets), PROBE_MAX_TARGETS, match_tgid ? "tgid" : "pid");
+	for (slot = 0; slot < PROBE_TARGET_SLOTS; slot++) {
+		id = READ_ONCE(target_table[slot]);
+		if (id == 0 || id == PROBE_TARGET_TOMBSTONE) {
+			continue;
+		}
+		faults = 0;
+		stored = 0;
+		last = 0;
+		gen = READ_ONCE(target_gen[slot]);
+		for_each_possible_cpu(cpu) {
+			target = &per_cpu_ptr(page_fault_stats_cpu, cpu)->targets[slot];
+			if (READ_ONCE(target->gen) != gen) {
+				continue;
+			}
+			faults += READ_ONCE(target->faults);
+			stored += READ_ONCE(target->stored);
+			last = max(last, READ_ONCE(target->last));
+		}
+		seq_printf(m, "  %8d: faults %llu, stored %llu, last fault at %ld\n", id, faults, stored, last);
+		cond_resched();
+	}
+	seq_printf(m, "commands: add <id>, del <id>, reset, set <mode> <value>\nmodes:");
+	for (idx = 0; idx < ARRAY_SIZE(probe_modes); idx++) {
+		seq_printf(m, " %s", probe_modes[idx].name);
+	}
+	seq_putc(m, '\n');
+	return 0;
+}
+
+
+/* file_operations write implementation of /proc/<module>/ctl, one command per line, stops at the first that fails */
+static ssize_t ctl_write(struct file *pfile, const char __user *buffer, size_t length, loff_t *offset) {
+
+	char *text;
+	char *cursor;
+	char *line;
+	char *command;
+	char *name;
+	int errors = 0;
+	int id;
+
+	if (length > PROBE_CTL_LEN) {
+		return -EINVAL;
+	}
+	text = memdup_user_nul(buffer, length);
+	if (IS_ERR(text)) {
+		return PTR_ERR(text);
+	}
+	cursor = text;
+	while (errors == 0 && (line = strsep(&cursor, "\n")) != NULL) {
+		line = strim(line);
+		command = strsep(&line, " \t");
+		if (*command == '\0') {
+			continue;
+		}
+		line = line != NULL ? skip_spaces(line) : NULL;
+		if (strcmp(command, "add") == 0 || strcmp(command, "del") == 0) {
+			errors = line != NULL ? kstrtoint(line, 10, &id) : -EINVAL;
+			if (errors == 0) {
+				errors = command[0] == 'a' ? add_target(id) : del_target(id);
+			}
+			if (errors == 0) {
+				printk(KERN_INFO "DEV Module: %s Target %d, %d Targets Traced\n", command[0] == 'a' ? "Added" : "Removed", id, nr_targets);
+			}
+		}
+		else if (strcmp(command, "reset") == 0) {
+			reset_faults();
+			printk(KERN_INFO "DEV Module: Records and Counts Reset\n");
+		}
+		else if (strcmp(command, "set") == 0 && line != NULL) {
+			name = strsep(&line, " \t");
+			errors = line != NULL ? set_probe_mode(name, skip_spaces(line)) : -EINVAL;
+		}
+		else {
+			errors = -EINVAL;
+		}
+		if (errors != 0) {
+			printk(KERN_INFO "DEV Module: Control Command %s Failed with Error %d\n", command, errors);
+		}
+	}
+	kfree(text);
+	return errors < 0 ? errors : length;
+}
+
+
+/*
+ * Memory for one ring on the given node. Rings up to the largest buddy order come from the
+ * kernel linear map, which is mapped with huge pages, so the tracer adds no TLB pressure of its own.
+ * Larger rings fall back to vmalloc. Pages are split so each one can be mapped into user space.
+ */
+static void *alloc_ring_area(int node) {
+
+	unsigned int order = get_order(ring_pages() * PAGE_SIZE);
+	struct page *pages;
+
+	if (order < MAX_ORDER) {
+		pages = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN | __GFP_NORETRY, order);
+		if (pages != NULL) {
+			split_page(pages, order);
+			return page_address(pages);
+		}
+	}
+	return vzalloc_node(ring_pages() * PAGE_SIZE, node);
+}
+
+
+static void free_ring_area(void *area) {
+
+	unsigned long page;
+
+	if (area == NULL) {
+		return;
+	}
+	if (is_vmalloc_addr(area)) {
+		vfree(area);
+		return;
+	}
+	for (page = 0; page < (1UL << get_order(ring_pages() * PAGE_SIZE)); page++) {
+		__free_page(virt_to_page((char *)area + page * PAGE_SIZE));
+	}
+}
+
+
+/* Give every possible CPU its own ring, placed on that CPU's memory node and mappable by user space */
+static int alloc_fault_rings(void) {
+
+	page_fault_ring *ring;
+	int cpu;
+
+	if (buffer_size == 0 || buffer_size > PROBE_BUFFER_MAX) {
+		printk(KERN_ALERT "DEV Module: Buffer Size %u out of Range 1 - %u\n", buffer_size, PROBE_BUFFER_MAX);
+		return -EINVAL;
+	}
+	if (compact > 2) {
+		printk(KERN_ALERT "DEV Module: Compact Mode %u out of Range 0 - 2\n", compact);
+		return -EINVAL;
+	}
+	record_size = compact ? sizeof(u64) : sizeof(page_fault_data);
+	if (hot_pages > PROBE_HOT_MAX) {
+		printk(KERN_ALERT "DEV Module: Hot Page Map Size %u out of Range 0 - %u\n", hot_pages, PROBE_HOT_MAX);
+		return -EINVAL;
+	}
+	hot_size = hot_pages != 0 ? roundup_pow_of_two(max(hot_pages, (unsigned int)PROBE_HOT_PROBE)) : 0;
+	// a column is a power of two nsec, so the record path finds it with a shift
+	heat_col_shift = ilog2(roundup_pow_of_two(max_t(u64, div_u64((u64)heat_window_ms * NSEC_PER_MSEC, PROBE_HEAT_COLS), 1)));
+	ring_size = roundup_pow_of_two(buffer_size);
+	ring_mask = ring_size - 1;
+
+	page_fault_info = (page_fault_mmap_info *)get_zeroed_page(GFP_KERNEL);
+	page_fault_rings = alloc_percpu(page_fault_ring);
+	page_fault_stats_cpu = alloc_percpu(page_fault_stats);
+	if (page_fault_info == NULL || page_fault_rings == NULL || page_fault_stats_cpu == NULL) {
+		free_fault_rings();
+		return -ENOMEM;
+	}
+	page_fault_info->magic = PROBE_MMAP_MAGIC;
+	page_fault_info->process_id = process_id;
+	page_fault_info->nr_rings = nr_cpu_ids;
+	page_fault_info->ring_pages = ring_pages();
+	page_fault_info->record_size = record_size;
+	page_fault_info->compact = compact;
+	page_fault_info->ring_size = ring_size;
+
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(page_fault_rings, cpu);
+		ring->ctrl = alloc_ring_area(cpu_to_node(cpu));
+		if (ring->ctrl == NULL) {
+			printk(KERN_ALERT "DEV Module: Failed to Allocate %lu Records for CPU %d\n", ring_size, cpu);
+			free_fault_rings();
+			return -ENOMEM;
+		}
+		ring->data = (page_fault_data *)((char *)ring->ctrl + PAGE_SIZE);
+		ring->packed = (u64 *)ring->data;
+		ring->seq = (u64)cpu << PROBE_SEQ_CPU_SHIFT | 1;
+		per_cpu_ptr(page_fault_stats_cpu, cpu)->targets = vzalloc_node(PROBE_TARGET_SLOTS * sizeof(page_fault_target), cpu_to_node(cpu));
+		if (per_cpu_ptr(page_fault_stats_cpu, cpu)->targets == NULL) {
+			printk(KERN_ALERT "DEV Module: Failed to Allocate Target Counts for CPU %d\n", cpu);
+			free_fault_rings();
+			return -ENOMEM;
+		}
+		if (hot_size != 0) {
+			per_cpu_ptr(page_fault_stats_cpu, cpu)->hot = vzalloc_node(hot_size * sizeof(page_fault_hot), cpu_to_node(cpu));
+			if (per_cpu_ptr(page_fault_stats_cpu, cpu)->hot == NULL) {
+				printk(KERN_ALERT "DEV Module: Failed to Allocate %lu Hot Pages for CPU %d\n", hot_size, cpu);
+				free_fault_rings();
+				return -ENOMEM;
+			}
+		}
+		if (heat_window_ms != 0) {
+			per_cpu_ptr(page_fault_stats_cpu, cpu)->heat = vzalloc_node(sizeof(page_fault_heat), cpu_to_node(cpu));
+			if (per_cpu_ptr(page_fault_stats_cpu, cpu)->heat == NULL) {
+				printk(KERN_ALERT "DEV Module: Failed to Allocate Heatmap for CPU %d\n", cpu);
+				free_fault_rings();
+				return -ENOMEM;
+			}
+		}
+		// probe_print can be switched on later, so the log is always there
+		per_cpu_ptr(page_fault_stats_cpu, cpu)->log = vzalloc_node(sizeof(page_fault_log), cpu_to_node(cpu));
+		if (per_cpu_ptr(page_fault_stats_cpu, cpu)->log == NULL) {
+			printk(KERN_ALERT "DEV Module: Failed to Allocate Message Log for CPU %d\n", cpu);
+			free_fault_rings();
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+
+static void free_fault_rings(void) {
+
+	int cpu;
+
+	if (page_fault_rings != NULL) {
+		for_each_possible_cpu(cpu) {
+			free_ring_area(per_cpu_ptr(page_fault_rings, cpu)->ctrl);
+			if (page_fault_stats_cpu != NULL) {
+				vfree(per_cpu_ptr(page_fault_stats_cpu, cpu)->targets);
+				vfree(per_cpu_ptr(page_fault_stats_cpu, cpu)->hot);
+				vfree(per_cpu_ptr(page_fault_stats_cpu, cpu)->heat);
+				vfree(per_cpu_ptr(page_fault_stats_cpu, cpu)->log);
+			}
+		}
+		free_percpu(page_fault_rings);
+		page_fault_rings = NULL;
+	}
+	if (page_fault_info != NULL) {
+		free_page((unsigned long)page_fault_info);
+		page_fault_info = NULL;
+	}
+	free_percpu(page_fault_stats_cpu);
+	page_fault_stats_cpu = NULL;
+}
+
+
+static void dev_cleanup(void) {
+
+	if (probe_ret >= 0 && latency) {
+		unregister_kretprobe(&dev_krp);
+		printk(KERN_ALERT "DEV Module: Return Probe at %p Unregistered, Missed %d Faults\n", dev_krp.kp.addr, dev_krp.nmissed);
+	}
+	else if (probe_ret >= 0 && attach_mode == PROBE_ATTACH_TRACEPOINT) {
+		unregister_fault_tracepoints();
+		printk(KERN_ALERT "DEV Module: Fault Tracepoints Unregistered\n");
+	}
+	else if (probe_ret >= 0 && attach_mode == PROBE_ATTACH_FTRACE) {
+		unregister_fault_ftrace();
+		printk(KERN_ALERT "DEV Module: Ftrace Probe on %s Unregistered\n", symbol);
+	}
+	else if (probe_ret >= 0) {
+		unregister_kprobe(&dev_kp);
+		printk(KERN_ALERT "DEV Module: Probe at %p Unregistered\n", dev_kp.addr);
+	}
+	if (follow_fork) {
+		unregister_fork_tracepoints();
+	}
+
+	if (dev_dir_entry != NULL) {
+		remove_proc_subtree(PROBE_NAME, NULL);
+		printk(KERN_INFO "DEV Module: Removed File Entries : /proc/%s\n", PROBE_NAME);
+	}
+
+	cancel_delayed_work_sync(&page_fault_wake_work);
+	irq_work_sync(&page_fault_irq_work);
+	// the probes are gone, print what they left in the logs
+	cancel_delayed_work_sync(&page_fault_log_work);
+	if (page_fault_stats_cpu != NULL) {
+		drain_fault_log();
+	}
+
+	free_fault_rings();
+}
+
+
+/* Write of a switch parameter, at load time or through /sys/module/<module>/parameters */
+static int probe_switch_set(const char *val, const struct kernel_param *kp) {
+
+	probe_switch *sw = (probe_switch *)kp->arg;
+	bool on;
+	int errors;
+
+	errors = kstrtobool(val, &on);
+	if (errors < 0) {
+		return errors;
+	}
+	if (on) {
+		static_branch_enable(&sw->key);
+	}
+	else {
+		static_branch_disable(&sw->key);
+	}
+	sw->set = 1;
+	return 0;
+}
+
+
+static int probe_switch_get(char *buffer, const struct kernel_param *kp) {
+
+	probe_switch *sw = (probe_switch *)kp->arg;
+
+	return sprintf(buffer, "%c\n", static_key_enabled(&sw->key) ? 'Y' : 'N');
+}
+
+
+static void probe_switch_default(probe_switch *sw, bool on) {
+
+	if (on && !sw->set) {
+		static_branch_enable(&sw->key);
+	}
+}
+
+
+static int __init pf_probe_init(void) {
+
+	int errors;
+	int idx;
+	int cpu;
+	char cpu_name[16];
+	char attached[64];
+
+	probe_switch_default(&probe_debug, PROBE_DEBUG);
+	probe_switch_default(&probe_print, PROBE_PRINT);
+	probe_switch_default(&cont_store, CONT_STORE);
+	for (attach_mode = 0; attach_mode < PROBE_ATTACH_MODES; attach_mode++) {
+		if (sysfs_streq(attach, attach_names[attach_mode])) {
+			break;
+		}
+	}
+	if (attach_mode == PROBE_ATTACH_MODES || (latency && attach_mode != PROBE_ATTACH_KPROBE)) {
+		printk(KERN_ALERT "DEV Module: Unknown Attach Mode %s, use kprobe, tracepoint or ftrace, latency=1 needs kprobe\n", attach);
+		return -EINVAL;
+	}
+	if (process_id != 0) {
+		errors = add_target(process_id);
+		if (errors < 0) {
+			printk(KERN_ALERT "DEV Module: Failed to Add Target %d Return Code %d\n", process_id, errors);
+			return errors;
+		}
+	}
+	for (idx = 0; idx < pid_list_len; idx++) {
+		if (add_target(pid_list[idx]) < 0) {
+			printk(KERN_ALERT "DEV Module: Failed to Add Target %d\n", pid_list[idx]);
+		}
+	}
+	if (nr_targets == 0) {
+		printk(KERN_ALERT "DEV Module: No Target Process, use process_id=<PID>, pid_list=<PID>,<PID> or add them later through /proc/%s/ctl\n", PROBE_NAME);
+	}
+
+	errors = alloc_fault_rings();
+	if (errors < 0) {
+		printk(KERN_ALERT "DEV Module: Failed to Allocate Per-CPU Fault Buffers\n");
+		return errors;
+	}
+	printk(KERN_INFO "DEV Module: Allocated %lu Records per CPU for %u CPUs\n", ring_size, nr_cpu_ids);
+	init_irq_work(&page_fault_irq_work, wake_readers);
+	schedule_delayed_work(&page_fault_wake_work, msecs_to_jiffies(max(wakeup_ms, 1U)));
+	schedule_delayed_work(&page_fault_log_work, msecs_to_jiffies(PROBE_LOG_FLUSH_MS));
+
+	dev_dir_entry = proc_mkdir(PROBE_NAME, NULL);
+	if (dev_dir_entry != NULL) {
+		dev_file_entry = proc_create("data", 0, dev_dir_entry, &dev_file_op);
+	}
+	if (dev_file_entry == NULL || proc_create("hist", 0444, dev_dir_entry, &dev_hist_op) == NULL ||
+			proc_create("stats", 0444, dev_dir_entry, &dev_stats_op) == NULL ||
+			proc_create("hot", 0444, dev_dir_entry, &dev_hot_op) == NULL ||
+			proc_create("heat", 0444, dev_dir_entry, &dev_heat_op) == NULL ||
+			proc_create("ctl", 0600, dev_dir_entry, &dev_ctl_op) == NULL) {
+		printk(KERN_ALERT "DEV Module: Failed to Create File Entry for %s\n", PROBE_NAME);
+		dev_cleanup();
+		return -EFAULT;
+	}
+	else {
+		printk(KERN_INFO "DEV Module: Created File Entries : /proc/%s/{data,hist,stats,hot,heat,ctl}, for User Space Program\n", PROBE_NAME);
+	}
+	for_each_possible_cpu(cpu) {
+		snprintf(cpu_name, sizeof(cpu_name), "cpu%d", cpu);
+		if (proc_create_data(cpu_name, 0, dev_dir_entry, &dev_file_op, (void *)(long)(cpu + 1)) == NULL) {
+			printk(KERN_ALERT "DEV Module: Failed to Create File Entry for %s/%s\n", PROBE_NAME, cpu_name);
+			dev_cleanup();
+			return -EFAULT;
+		}
+	}
+	printk(KERN_INFO "DEV Module: Created File Entries : /proc/%s/cpu<N>, one per CPU\n", PROBE_NAME);
+
+	// children forked once the fault probe is in place must already be followed
+	if (follow_fork) {
+		errors = register_fork_tracepoints();
+		if (errors < 0) {
+			printk(KERN_ALERT "DEV Module: Failed to Follow Forks of the Targets\n");
+			dev_cleanup();
+			return errors;
+		}
+	}
+
+	if (latency) {
+		// a fault can sleep on I/O, so allow many more instances than kretprobe's default
+		dev_krp.maxactive = latency_maxactive > 0 ? latency_maxactive : max(64, 4 * (int)num_possible_cpus());
+		probe_ret = register_kretprobe(&dev_krp);
+	}
+	else if (attach_mode == PROBE_ATTACH_TRACEPOINT) {
+		probe_ret = register_fault_tracepoints();
+	}
+	else if (attach_mode == PROBE_ATTACH_FTRACE) {
+		probe_ret = register_fault_ftrace();
+	}
+	else {
+		probe_ret = register_kprobe(&dev_kp);
+	}
+	if (probe_ret < 0) {
+		printk(KERN_ALERT "DEV Module: Register Probe Failed Return Code %d\n", probe_ret);
+		dev_cleanup();
 		return probe_ret;
 	}
 	else {
-		printk(KERN_ALERT "DEV Module: Registered Probe for PID %d at Address %p\n", process_id, dev_kp.addr);
-		if (PROBE_DEBUG) {
+		// only the kprobes have an address, the tracepoints and ftrace are named by what they hook
+		if (latency) {
+			snprintf(attached, sizeof(attached), "%s at Address %p", symbol, dev_krp.kp.addr);
+		}
+		else if (attach_mode == PROBE_ATTACH_TRACEPOINT) {
+			snprintf(attached, sizeof(attached), "%s and %s", fault_tracepoint_names[0], fault_tracepoint_names[1]);
+		}
+		else if (attach_mode == PROBE_ATTACH_FTRACE) {
+			snprintf(attached, sizeof(attached), "%s", symbol);
+		}
+		else {
+			snprintf(attached, sizeof(attached), "%s at Address %p", symbol, dev_kp.addr);
+		}
+		printk(KERN_ALERT "DEV Module: Registered %s Probe for PID %d and %d More %s%s on %s\n", latency ? "kretprobe" : attach_names[attach_mode], process_id, pid_list_len, match_tgid ? "Processes" : "Threads",
+			follow_fork ? " and Their Children" : "", attached);
+		if (probe_switch_on(probe_debug)) {
 			printk(KERN_INFO "DEV Module: %s Probe Installed ...\n", PROBE_NAME);
 		}
 	}
@@ -285,7 +2984,7 @@ static int __init pf_probe_init(void) {
 
 static void __exit pf_probe_exit(void) {
 	dev_cleanup();
-	if (PROBE_DEBUG) {
+	if (probe_switch_on(probe_debug)) {
 		printk(KERN_INFO "%s Module: Removed ...\n", PROBE_NAME);
 	}
 }
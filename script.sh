@@ -1,10 +1,20 @@
 #! /bin/bash
-###### Run command from parameters in background
-$* &
+###### Usage: ./script.sh [-f] <command>, with -f every process the command forks is traced too
+follow=""
+if [ "$1" = "-f" ]; then
+	follow="follow_fork=1"
+	shift
+fi
+fifo=$(mktemp -u)
+mkfifo $fifo
+###### Run command from parameters in background, held until the probe is in place so no fault or child is missed
+(read go < $fifo; exec $*) &
 ###### Save pid of last background command
 pid=$!
 ###### Install probe, running on the pid specified
-sudo insmod pf_probe_A.ko process_id=$pid
+sudo insmod pf_probe_A.ko process_id=$pid $follow
+echo go > $fifo
+rm -f $fifo
 ###### wait for the background job to complete
 wait $pid
 ###### Remove the module
@@ -7,83 +7,1225 @@
  *  State University of New York, Binghamton
  */
 
+#define _GNU_SOURCE
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <signal.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 
 
 #define DRIVER_NAME "Dev Page Fault Driver"
-#define DRIVER_PATH "/proc/pf_probe_B"
+#define DRIVER_PATH "/proc/pf_probe_B/data"
+#define DRIVER_CPU_PATH "/proc/pf_probe_B/cpu%d"
+#define DRIVER_COMPACT_PATH "/sys/module/pf_probe_B/parameters/compact"
 #define PROBE_LOG_NAME "./out/pf_probe_B.log"
+#define PROBE_TRACE_NAME "./out/pf_probe_B.pft"
+#define PROBE_MMAP_MAGIC 0x50465242
 
 #define USER_SLEEP 5
+#define USER_READ_BATCH 4096
+#define USER_MAX_CPUS 4096	// CPUs whose seq gaps are tracked
+#define USER_ROUND_RECORDS 65536	// records one CPU reader collects per merge round at most
 
 #define USER_DEBUG 0
 
+#define PROBE_REC_LATENCY 0x0001
+#define PROBE_REC_WEIGHT_SHIFT 8	// log2 of the faults a sampled record stands for
+
+#define PROBE_PACK_ESCAPE (1ULL << 63)
+#define PROBE_PACK_VPN (1ULL << 62)
+#define PROBE_PACK_PAYLOAD ((1ULL << 62) - 1)
+#define PROBE_PACK_SEQ (1ULL << 61)
+#define PROBE_PACK_FLAG_BITS 7
+#define PROBE_PACK_DELTA_SHIFT 7
+#define PROBE_PACK_DELTA_BITS 21
+#define PROBE_PACK_LINE_BITS 6
+#define PROBE_PACK_VPN_SHIFT 28
+#define PROBE_PACK_TIME_BITS 58
+#define PROBE_PACK_MAX_WORDS 4
+#define PROBE_SEQ_CPU_SHIFT 48
+
+#define TRACE_MAGIC "PFT1"
+#define TRACE_BLOCK_MAGIC "PFB1"
+#define TRACE_INDEX_MAGIC "PFTI"
+#define TRACE_VERSION 1
+#define TRACE_BLOCK_RECORDS 4096
+#define TRACE_RECORD_MAX 48	// varint bytes of one record at worst
+
+
+/* Must match the layout used by the pf_probe modules */
+typedef struct page_fault_data {
+	unsigned long address;
+	long time;
+	pid_t pid;
+	pid_t tgid;
+	uint32_t latency;
+	uint16_t ret;
+	uint16_t flags;
+	uint64_t seq;
+} page_fault_data;
+
+
+typedef struct page_fault_mmap_info {
+	uint32_t magic;
+	int32_t process_id;
+	uint32_t nr_rings;
+	uint32_t ring_pages;
+	uint32_t record_size;
+	uint32_t ring_size;
+	uint32_t compact;
+} page_fault_mmap_info;
+
+
+typedef struct page_fault_ring_ctrl {
+	uint64_t head;
+	uint64_t dropped;
+	uint64_t overwritten;
+	uint64_t start;
+	uint64_t pad[12];
+	uint64_t tail;
+} page_fault_ring_ctrl;
+
+
+/* Decoding state of a packed record stream, as in the modules */
+typedef struct page_fault_pack {
+	long time;
+	unsigned long vpn;
+	unsigned int weight;
+	uint64_t seq;
+} page_fault_pack;
+
+
+/*
+ * Binary trace file, little endian: a trace_header, then blocks of up to TRACE_BLOCK_RECORDS records,
+ * then the index of every block and a trace_trailer. Each block starts from zero, so it decodes on its own:
+ * a record is the zigzag varint deltas of time, address, pid and tgid from the previous record,
+ * the varint flags, and the varint latency and ret when PROBE_REC_LATENCY is set.
+ */
+typedef struct trace_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t block_records;
+	uint32_t reserved;
+} trace_header;
+
+
+/* Written in front of every block, length bytes of records follow */
+typedef struct trace_block_header {
+	char magic[4];
+	uint32_t records;
+	uint32_t length;
+	uint32_t reserved;
+	int64_t first_time;
+	int64_t last_time;
+} trace_block_header;
+
+
+/* One entry per block at the end of the file, so a reader can go straight to a time range */
+typedef struct trace_index_entry {
+	uint64_t offset;
+	int64_t first_time;
+	int64_t last_time;
+	uint32_t records;
+	uint32_t reserved;
+} trace_index_entry;
+
+
+/* Last bytes of a complete trace, a trace cut short has none and is read block by block */
+typedef struct trace_trailer {
+	uint64_t index_offset;
+	uint32_t blocks;
+	char magic[4];
+} trace_trailer;
+
+
+typedef struct trace_writer {
+	FILE *file;
+	uint8_t *block;
+	size_t length;
+	trace_block_header header;
+	page_fault_data prev;
+	trace_index_entry *index;
+	size_t blocks;
+	size_t index_size;
+} trace_writer;
+
+
+/* One reader thread pinned to a CPU, it drains /proc/pf_probe_B/cpuN into records each round */
+typedef struct cpu_reader {
+	pthread_t thread;
+	pthread_barrier_t *start;
+	pthread_barrier_t *done;
+	int cpu;
+	int fd;
+	int compact;
+	int error;
+	page_fault_pack pack;
+	page_fault_data *records;
+	size_t count;	// records collected this round
+	size_t next;	// next record the merge takes
+	void *batch;
+} cpu_reader;
+
+
+static int follow = 0;
+static int skip_stored = 0;
+static trace_writer *trace = NULL;
+static int trace_errors = 0;
+// set by Ctrl-C or a failed trace write, the read loops return and main closes the trace once they have
+static volatile sig_atomic_t stop_reading = 0;
+
 
 void exit_handler(int signal) {
-	printf("You have presses Ctrl-C\n");
-	exit(0);
+	const char message[] = "You have presses Ctrl-C\n";
+	ssize_t written;
+
+	// only async-signal-safe calls here, the reader threads may be in the middle of a record
+	written = write(STDOUT_FILENO, message, sizeof(message) - 1);
+	(void)written;
+	stop_reading = 1;
+}
+
+
+void trace_append(trace_writer *, page_fault_data *);
+
+
+/* Report the records a CPU lost before this one, from the gap in its seq */
+void check_seq(page_fault_data *entry) {
+
+	static uint64_t next_seq[USER_MAX_CPUS];
+	uint64_t cpu = entry->seq >> PROBE_SEQ_CPU_SHIFT;
+
+	if (entry->seq == 0 || cpu >= USER_MAX_CPUS) {
+		return;
+	}
+	if (next_seq[cpu] != 0 && entry->seq > next_seq[cpu]) {
+		fprintf(stderr, "Lost %lu records of CPU %lu before Seq %lu\n", (unsigned long)(entry->seq - next_seq[cpu]), (unsigned long)cpu,
+			(unsigned long)(entry->seq & ((1ULL << PROBE_SEQ_CPU_SHIFT) - 1)));
+	}
+	next_seq[cpu] = entry->seq + 1;
+}
+
+
+/* Same line format as the module's text mode, or the next record of the binary trace with -t */
+void log_record(FILE *log_file, int count, page_fault_data *entry) {
+
+	check_seq(entry);
+	if (trace != NULL) {
+		trace_append(trace, entry);
+		return;
+	}
+	fprintf(log_file, "%4d:: PID = %8d Page Fault at Address 0x%lx at Time %ld Flags 0x%x", count, entry->pid, entry->address, entry->time, entry->flags);
+	if (entry->seq != 0) {
+		fprintf(log_file, " Cpu %lu Seq %lu", (unsigned long)(entry->seq >> PROBE_SEQ_CPU_SHIFT), (unsigned long)(entry->seq & ((1ULL << PROBE_SEQ_CPU_SHIFT) - 1)));
+	}
+	if (entry->flags & PROBE_REC_LATENCY) {
+		fprintf(log_file, " Latency %u Ret 0x%x", entry->latency, entry->ret);
+	}
+	fprintf(log_file, "\n");
+}
+
+
+uint64_t zigzag(int64_t value) {
+	return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+
+int64_t unzigzag(uint64_t value) {
+	return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+
+/* 7 bits per byte, low bits first, the top bit set on every byte but the last */
+size_t put_varint(uint8_t *out, uint64_t value) {
+
+	size_t len = 0;
+
+	while (value >= 0x80) {
+		out[len++] = (uint8_t)value | 0x80;
+		value >>= 7;
+	}
+	out[len++] = (uint8_t)value;
+	return len;
+}
+
+
+int get_varint(const uint8_t **in, const uint8_t *end, uint64_t *value) {
+
+	int shift = 0;
+
+	*value = 0;
+	while (*in < end && shift < 64) {
+		*value |= (uint64_t)(**in & 0x7f) << shift;
+		if ((*(*in)++ & 0x80) == 0) {
+			return 0;
+		}
+		shift += 7;
+	}
+	return -1;
+}
+
+
+trace_writer *trace_open(const char *path) {
+
+	trace_writer *writer;
+	trace_header header = { TRACE_MAGIC, TRACE_VERSION, TRACE_BLOCK_RECORDS, 0 };
+
+	writer = calloc(1, sizeof(trace_writer));
+	if (writer == NULL) {
+		return NULL;
+	}
+	writer->block = malloc(TRACE_BLOCK_RECORDS * TRACE_RECORD_MAX);
+	writer->file = fopen(path, "wb");
+	if (writer->block == NULL || writer->file == NULL || fwrite(&header, sizeof(header), 1, writer->file) != 1) {
+		if (writer->file != NULL) {
+			fclose(writer->file);
+		}
+		free(writer->block);
+		free(writer);
+		return NULL;
+	}
+	return writer;
+}
+
+
+/*
+ * Write out the block being filled and note it in the index once it is on file.
+ * The block is started over either way, a block that failed to write is lost and left out of the index.
+ */
+int trace_flush_block(trace_writer *writer) {
+
+	trace_index_entry *index;
+	long offset;
+	int errors = 0;
+
+	if (writer->header.records == 0) {
+		return 0;
+	}
+	if (writer->blocks == writer->index_size) {
+		index = realloc(writer->index, (writer->index_size ? 2 * writer->index_size : 64) * sizeof(trace_index_entry));
+		if (index != NULL) {
+			writer->index_size = writer->index_size ? 2 * writer->index_size : 64;
+			writer->index = index;
+		}
+	}
+	memcpy(writer->header.magic, TRACE_BLOCK_MAGIC, 4);
+	writer->header.length = writer->length;
+	offset = ftell(writer->file);
+	if (writer->blocks == writer->index_size || offset < 0 || fwrite(&writer->header, sizeof(writer->header), 1, writer->file) != 1 ||
+		fwrite(writer->block, 1, writer->length, writer->file) != writer->length) {
+		errors = -1;
+	}
+	else {
+		index = &writer->index[writer->blocks++];
+		index->offset = offset;
+		index->first_time = writer->header.first_time;
+		index->last_time = writer->header.last_time;
+		index->records = writer->header.records;
+		index->reserved = 0;
+	}
+	memset(&writer->header, 0, sizeof(writer->header));
+	memset(&writer->prev, 0, sizeof(writer->prev));
+	writer->length = 0;
+	return errors;
+}
+
+
+void trace_append(trace_writer *writer, page_fault_data *entry) {
+
+	uint8_t *out = writer->block + writer->length;
+
+	if (trace_errors != 0) {
+		return;
+	}
+	if (writer->header.records == 0) {
+		writer->header.first_time = entry->time;
+	}
+	out += put_varint(out, zigzag(entry->time - writer->prev.time));
+	out += put_varint(out, zigzag((int64_t)(entry->address - writer->prev.address)));
+	out += put_varint(out, zigzag((int64_t)entry->pid - writer->prev.pid));
+	out += put_varint(out, zigzag((int64_t)entry->tgid - writer->prev.tgid));
+	out += put_varint(out, entry->flags);
+	if (entry->flags & PROBE_REC_LATENCY) {
+		out += put_varint(out, entry->latency);
+		out += put_varint(out, entry->ret);
+	}
+	writer->length = out - writer->block;
+	writer->prev = *entry;
+	writer->header.last_time = entry->time;
+	writer->header.records += 1;
+	if (writer->header.records >= TRACE_BLOCK_RECORDS && trace_flush_block(writer) < 0) {
+		// the blocks written so far still get their index when main calls trace_close
+		trace_errors = errno != 0 ? errno : EIO;
+		fprintf(stderr, "Failed to write trace block, %s, stopping\n", strerror(trace_errors));
+		stop_reading = 1;
+	}
+}
+
+
+/* Called by main once the read loops returned, so a trace stopped with Ctrl-C still gets its last block and index */
+void trace_close(void) {
+
+	trace_trailer trailer = { 0, 0, TRACE_INDEX_MAGIC };
+
+	if (trace == NULL) {
+		return;
+	}
+	if (trace_flush_block(trace) == 0) {
+		trailer.index_offset = ftell(trace->file);
+		trailer.blocks = trace->blocks;
+		fwrite(trace->index, sizeof(trace_index_entry), trace->blocks, trace->file);
+		fwrite(&trailer, sizeof(trailer), 1, trace->file);
+	}
+	fclose(trace->file);
+	free(trace->index);
+	free(trace->block);
+	free(trace);
+	trace = NULL;
+}
+
+
+/* Decode one block of records and print those in [from, to], returns the records printed or -1 */
+int convert_block(FILE *file, trace_block_header *header, long from, long to, int count) {
+
+	uint8_t *block;
+	const uint8_t *in;
+	const uint8_t *end;
+	uint64_t value[4];
+	uint32_t idx;
+	page_fault_data entry;
+	int printed = 0;
+
+	block = malloc(header->length);
+	if (block == NULL || fread(block, 1, header->length, file) != header->length) {
+		free(block);
+		return -1;
+	}
+	in = block;
+	end = block + header->length;
+	memset(&entry, 0, sizeof(entry));
+	for (idx = 0; idx < header->records; idx++) {
+		if (get_varint(&in, end, &value[0]) < 0 || get_varint(&in, end, &value[1]) < 0 || get_varint(&in, end, &value[2]) < 0 || get_varint(&in, end, &value[3]) < 0) {
+			break;
+		}
+		entry.time += unzigzag(value[0]);
+		entry.address += unzigzag(value[1]);
+		entry.pid += unzigzag(value[2]);
+		entry.tgid += unzigzag(value[3]);
+		if (get_varint(&in, end, &value[0]) < 0) {
+			break;
+		}
+		entry.flags = value[0];
+		entry.latency = 0;
+		entry.ret = 0;
+		if (entry.flags & PROBE_REC_LATENCY) {
+			if (get_varint(&in, end, &value[0]) < 0 || get_varint(&in, end, &value[1]) < 0) {
+				break;
+			}
+			entry.latency = value[0];
+			entry.ret = value[1];
+		}
+		if (entry.time >= from && entry.time <= to) {
+			log_record(stdout, count + printed, &entry);
+			printed += 1;
+		}
+	}
+	free(block);
+	return idx == header->records ? printed : -1;
+}
+
+
+/* Print a binary trace as text lines, only the blocks whose time range meets [from, to] are decoded */
+int convert_trace(const char *path, long from, long to) {
+
+	FILE *file;
+	trace_header header;
+	trace_block_header block;
+	trace_trailer trailer;
+	trace_index_entry *index = NULL;
+	uint32_t idx;
+	long blocks_end;
+	int count = 0;
+	int printed;
+
+	file = fopen(path, "rb");
+	if (file == NULL) {
+		fprintf(stderr, "Failed to open trace %s\n", path);
+		return errno;
+	}
+	if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TRACE_MAGIC, 4) != 0 || header.version != TRACE_VERSION) {
+		fprintf(stderr, "%s is not a page fault trace\n", path);
+		fclose(file);
+		return EINVAL;
+	}
+	// use the index when the trace was closed properly
+	if (fseek(file, -(long)sizeof(trailer), SEEK_END) == 0 && fread(&trailer, sizeof(trailer), 1, file) == 1 && memcmp(trailer.magic, TRACE_INDEX_MAGIC, 4) == 0) {
+		index = malloc((trailer.blocks ? trailer.blocks : 1) * sizeof(trace_index_entry));
+		if (index == NULL || fseek(file, trailer.index_offset, SEEK_SET) != 0 || fread(index, sizeof(trace_index_entry), trailer.blocks, file) != trailer.blocks) {
+			free(index);
+			index = NULL;
+		}
+	}
+	if (index != NULL) {
+		for (idx = 0; idx < trailer.blocks; idx++) {
+			if (index[idx].last_time < from || index[idx].first_time > to) {
+				continue;
+			}
+			if (fseek(file, index[idx].offset, SEEK_SET) != 0 || fread(&block, sizeof(block), 1, file) != 1) {
+				break;
+			}
+			printed = convert_block(file, &block, from, to, count);
+			if (printed < 0) {
+				break;
+			}
+			count += printed;
+		}
+		free(index);
+	}
+	else {
+		// cut short, walk the block headers and skip what is out of range
+		fseek(file, 0, SEEK_END);
+		blocks_end = ftell(file);
+		fseek(file, sizeof(header), SEEK_SET);
+		while (ftell(file) + (long)sizeof(block) <= blocks_end && fread(&block, sizeof(block), 1, file) == 1 && memcmp(block.magic, TRACE_BLOCK_MAGIC, 4) == 0) {
+			if (block.last_time < from || block.first_time > to) {
+				fseek(file, block.length, SEEK_CUR);
+				continue;
+			}
+			printed = convert_block(file, &block, from, to, count);
+			if (printed < 0) {
+				break;
+			}
+			count += printed;
+		}
+	}
+	fclose(file);
+	fprintf(stderr, "Converted %d records from %s\n", count, path);
+	return 0;
+}
+
+
+/*
+ * Record format of the module from its compact parameter, 0 for full records, -1 if it cannot be read.
+ * Only read() consumers ask, so this stays off the info page: mapping it would make this process an mmap consumer.
+ */
+int record_format(void) {
+
+	int compact = -1;
+	FILE *file;
+
+	file = fopen(DRIVER_COMPACT_PATH, "r");
+	if (file == NULL) {
+		return -1;
+	}
+	if (fscanf(file, "%d", &compact) != 1) {
+		compact = -1;
+	}
+	fclose(file);
+	return compact;
+}
+
+
+/* Apply one packed word to the stream state, returns 1 when it completed a fault in entry */
+int unpack_fault(page_fault_pack *pack, uint64_t word, int compact, page_fault_data *entry) {
+
+	int page_shift = __builtin_ctzl(sysconf(_SC_PAGESIZE));
+	int delta_bits = compact == 2 ? PROBE_PACK_DELTA_BITS - PROBE_PACK_LINE_BITS : PROBE_PACK_DELTA_BITS;
+	unsigned long vpn;
+
+	if (word & PROBE_PACK_ESCAPE) {
+		if ((word & PROBE_PACK_VPN) && (word & PROBE_PACK_SEQ)) {
+			pack->seq = word & (PROBE_PACK_SEQ - 1);
+		}
+		else if (word & PROBE_PACK_VPN) {
+			pack->vpn = word & PROBE_PACK_PAYLOAD;
+		}
+		else {
+			pack->time = word & ((1ULL << PROBE_PACK_TIME_BITS) - 1);
+			pack->weight = (word & PROBE_PACK_PAYLOAD) >> PROBE_PACK_TIME_BITS;
+		}
+		return 0;
+	}
+	if (pack->time == 0) {
+		pack->vpn = 0;
+		return 0;
+	}
+	vpn = pack->vpn != 0 ? pack->vpn : word >> PROBE_PACK_VPN_SHIFT;
+	pack->vpn = 0;
+	pack->time += (word >> PROBE_PACK_DELTA_SHIFT) & ((1ULL << delta_bits) - 1);
+	memset(entry, 0, sizeof(page_fault_data));
+	entry->address = vpn << page_shift;
+	if (compact == 2) {
+		entry->address |= ((word >> (PROBE_PACK_VPN_SHIFT - PROBE_PACK_LINE_BITS)) & ((1 << PROBE_PACK_LINE_BITS) - 1)) << (page_shift - PROBE_PACK_LINE_BITS);
+	}
+	entry->time = pack->time;
+	entry->flags = (word & ((1 << PROBE_PACK_FLAG_BITS) - 1)) << 1 | pack->weight << PROBE_REC_WEIGHT_SHIFT;
+	entry->seq = pack->seq;
+	if (pack->seq != 0) {
+		pack->seq += 1;
+	}
+	return 1;
+}
+
+
+/* Sleep in the kernel until the module has new records for this descriptor */
+int wait_for_records(int fd) {
+
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	// Ctrl-C returns with nothing new, the caller checks stop_reading
+	while (poll(&pfd, 1, -1) < 0 && !stop_reading) {
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+	return 0;
 }
 
 
-int main(int argc, char const *argv[]) {
+/* Read one formatted line per fault until the module sends EXIT_CODE */
+int read_text_mode(FILE *log_file) {
 
 	ssize_t read;
 	size_t len = 0;
 	int count = 0;
 	FILE *file;
-	FILE *log_file;
 	char *line = NULL;
 
-	printf("This is a simple program to interact with %s\n", DRIVER_NAME);
-
 	file = fopen(DRIVER_PATH, "r");
 	if (file == NULL) {
 		fprintf(stderr, "Failed to open path %s, of %s\n", DRIVER_PATH, DRIVER_NAME);
 		return errno;
 	}
-	else {
-		if (USER_DEBUG) {
-			printf("Reading from the %s\n", DRIVER_PATH);
-		}
-		log_file = fopen(PROBE_LOG_NAME, "w");
-		if (log_file == NULL) {
-			fprintf(stderr, "Failed to create log path %s\n", PROBE_LOG_NAME);
-		}
-		signal(SIGINT, exit_handler);
-		while (1) {
-			read = getline(&line, &len, file);
-			if (read < 0){
-				fprintf(stderr, "Failed to read the message from the %s\n", DRIVER_PATH);
-				return errno;
-			}
-			else {
-				pid_t pid = getpid();
-				if (strcmp(line, "EXIT_CODE\n")!=0) {
-					printf("%4d:: %s", count, line);
-					fprintf(log_file, "%4d:: %s", count, line);
-					count += 1;
+	// stdio would turn SEEK_END into an offset from the size of the proc file, which is 0, so seek the fd before the first read
+	if (skip_stored && lseek(fileno(file), 0, SEEK_END) < 0) {
+		fprintf(stderr, "Failed to skip the stored records of %s\n", DRIVER_PATH);
+		fclose(file);
+		return errno;
+	}
+	if (USER_DEBUG) {
+		printf("Reading from the %s\n", DRIVER_PATH);
+	}
+	while (!stop_reading) {
+		read = getline(&line, &len, file);
+		if (read < 0 && stop_reading) {
+			break;
+		}
+		if (read < 0){
+			fprintf(stderr, "Failed to read the message from the %s\n", DRIVER_PATH);
+			return errno;
+		}
+		else {
+			pid_t pid = getpid();
+			if (strcmp(line, "EXIT_CODE\n")==0 && follow) {
+				// drained for now, wait for the module instead of polling with sleeps
+				if (wait_for_records(fileno(file)) < 0) {
+					return errno;
+				}
+			}
+			else if (strcmp(line, "EXIT_CODE\n")!=0) {
+				printf("%4d:: %s", count, line);
+				fprintf(log_file, "%4d:: %s", count, line);
+				count += 1;
+				if (!follow) {
 					if (USER_DEBUG) {
 						printf("Process %d sleeping for %d msec.\n", pid, USER_SLEEP);
 					}
 					usleep(USER_SLEEP * 10000);
 				}
-				else{
-					printf("Reading from the %s Completed\n", DRIVER_PATH);
-					break;
+			}
+			else{
+				printf("Reading from the %s Completed\n", DRIVER_PATH);
+				break;
+			}
+		}
+	}
+	fclose(file);
+	if (line) {
+		free(line);
+	}
+	return 0;
+}
+
+
+/* Pull whole blocks of raw records, the module must have been loaded with read_binary=1 */
+int read_binary_mode(FILE *log_file) {
+
+	int fd;
+	int count = 0;
+	int compact;
+	ssize_t read_len = 0;
+	ssize_t idx;
+	page_fault_data *batch;
+	page_fault_data entry;
+	page_fault_pack pack = { 0 };
+
+	fd = open(DRIVER_PATH, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open path %s, of %s\n", DRIVER_PATH, DRIVER_NAME);
+		return errno;
+	}
+	compact = record_format();
+	if (skip_stored && lseek(fd, 0, SEEK_END) < 0) {
+		fprintf(stderr, "Failed to skip the stored records of %s\n", DRIVER_PATH);
+		close(fd);
+		return errno;
+	}
+	batch = malloc(USER_READ_BATCH * sizeof(page_fault_data));
+	if (batch == NULL) {
+		close(fd);
+		return ENOMEM;
+	}
+	while (!stop_reading) {
+		read_len = read(fd, batch, USER_READ_BATCH * sizeof(page_fault_data));
+		if (read_len < 0 && stop_reading) {
+			read_len = 0;
+			break;
+		}
+		if (read_len == 0 && follow) {
+			if (wait_for_records(fd) < 0) {
+				read_len = -1;
+				break;
+			}
+			continue;
+		}
+		if (read_len <= 0) {
+			break;
+		}
+		if (read_len % (compact > 0 ? sizeof(uint64_t) : sizeof(page_fault_data)) != 0 || strncmp((char *)batch, "PID =", 5) == 0) {
+			fprintf(stderr, "%s is not in binary mode, load it with read_binary=1\n", DRIVER_PATH);
+			read_len = -1;
+			errno = EINVAL;
+			break;
+		}
+		if (compact > 0) {
+			// one stream of packed words, the module packs the merged faults again for each file
+			for (idx = 0; idx < read_len / (ssize_t)sizeof(uint64_t); idx++) {
+				if (unpack_fault(&pack, ((uint64_t *)batch)[idx], compact, &entry)) {
+					log_record(log_file, count, &entry);
+					count += 1;
 				}
 			}
+			continue;
 		}
-		fclose(file);
-		fclose(log_file);
-		if (line) {
-			free(line);
+		for (idx = 0; idx < read_len / (ssize_t)sizeof(page_fault_data); idx++) {
+			log_record(log_file, count, &batch[idx]);
+			count += 1;
+		}
+	}
+	if (read_len < 0) {
+		fprintf(stderr, "Failed to read the records from the %s\n", DRIVER_PATH);
+	}
+	else {
+		printf("Reading %d records from the %s Completed\n", count, DRIVER_PATH);
+	}
+	free(batch);
+	close(fd);
+	return read_len < 0 ? errno : 0;
+}
+
+
+static volatile int readers_stop = 0;
+// held while the reader threads are created, the barriers are only sized once it is known how many started
+static pthread_mutex_t readers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Read this CPU's file until it is drained or the round is full, unpacking compact words on the way */
+int drain_cpu_reader(cpu_reader *reader) {
+
+	ssize_t read_len;
+	ssize_t idx;
+	size_t record_size = reader->compact > 0 ? sizeof(uint64_t) : sizeof(page_fault_data);
+
+	reader->count = 0;
+	reader->next = 0;
+	// a compact word may hold no fault or a whole one, leave room for a full batch either way
+	while (reader->count + USER_READ_BATCH <= USER_ROUND_RECORDS) {
+		read_len = read(reader->fd, reader->batch, USER_READ_BATCH * record_size);
+		if (read_len < 0 && errno == EAGAIN) {
+			break;
+		}
+		if (read_len < 0 || read_len % record_size != 0 || (read_len > 0 && strncmp((char *)reader->batch, "PID =", 5) == 0)) {
+			return read_len < 0 ? errno : EINVAL;
+		}
+		if (read_len == 0) {
+			break;
+		}
+		if (reader->compact <= 0) {
+			memcpy(&reader->records[reader->count], reader->batch, read_len);
+			reader->count += read_len / sizeof(page_fault_data);
+			continue;
+		}
+		for (idx = 0; idx < read_len / (ssize_t)sizeof(uint64_t); idx++) {
+			if (unpack_fault(&reader->pack, ((uint64_t *)reader->batch)[idx], reader->compact, &reader->records[reader->count])) {
+				reader->count += 1;
+			}
 		}
 	}
 	return 0;
 }
+
+
+void *cpu_reader_thread(void *arg) {
+
+	cpu_reader *reader = (cpu_reader *)arg;
+	cpu_set_t mask;
+
+	// reading on the CPU that wrote the ring keeps its records in that CPU's cache
+	CPU_ZERO(&mask);
+	CPU_SET(reader->cpu, &mask);
+	pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+	pthread_mutex_lock(&readers_lock);
+	pthread_mutex_unlock(&readers_lock);
+	while (1) {
+		pthread_barrier_wait(reader->start);
+		if (readers_stop) {
+			break;
+		}
+		if (reader->error == 0) {
+			reader->error = drain_cpu_reader(reader);
+		}
+		pthread_barrier_wait(reader->done);
+	}
+	return NULL;
+}
+
+
+/* Swap a reader down the merge heap until its next record is not older than its children's */
+void sift_down(cpu_reader **heap, int size, int idx) {
+
+	cpu_reader *swap;
+	int child;
+
+	while ((child = 2 * idx + 1) < size) {
+		if (child + 1 < size && heap[child + 1]->records[heap[child + 1]->next].time < heap[child]->records[heap[child]->next].time) {
+			child += 1;
+		}
+		if (heap[idx]->records[heap[idx]->next].time <= heap[child]->records[heap[child]->next].time) {
+			break;
+		}
+		swap = heap[idx];
+		heap[idx] = heap[child];
+		heap[child] = swap;
+		idx = child;
+	}
+}
+
+
+/* k-way merge of what every CPU reader collected this round, each of them is already in time order */
+int merge_cpu_readers(FILE *log_file, cpu_reader *readers, cpu_reader **heap, int nr_readers, int count) {
+
+	int size = 0;
+	int idx;
+
+	for (idx = 0; idx < nr_readers; idx++) {
+		if (readers[idx].count > 0) {
+			heap[size++] = &readers[idx];
+		}
+	}
+	for (idx = size / 2 - 1; idx >= 0; idx--) {
+		sift_down(heap, size, idx);
+	}
+	while (size > 0) {
+		log_record(log_file, count, &heap[0]->records[heap[0]->next]);
+		count += 1;
+		heap[0]->next += 1;
+		if (heap[0]->next == heap[0]->count) {
+			heap[0] = heap[--size];
+		}
+		sift_down(heap, size, 0);
+	}
+	return count;
+}
+
+
+/* Collect with one pinned reader thread per CPU file, the module must have been loaded with read_binary=1 */
+int read_cpu_mode(FILE *log_file) {
+
+	int nr_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	int nr_readers = 0;
+	int nr_started = 0;
+	int count = 0;
+	int errors = 0;
+	int collected;
+	int fd;
+	int idx;
+	char path[64];
+	cpu_reader *reader;
+	cpu_reader *readers;
+	cpu_reader **heap;
+	struct pollfd *pfds;
+	pthread_barrier_t start_barrier;
+	pthread_barrier_t done_barrier;
+	sigset_t sigint;
+	sigset_t old_mask;
+
+	readers = calloc(nr_cpus, sizeof(cpu_reader));
+	heap = calloc(nr_cpus, sizeof(cpu_reader *));
+	pfds = calloc(nr_cpus, sizeof(struct pollfd));
+	if (readers == NULL || heap == NULL || pfds == NULL) {
+		errors = ENOMEM;
+		goto cleanup;
+	}
+	for (idx = 0; idx < nr_cpus; idx++) {
+		snprintf(path, sizeof(path), DRIVER_CPU_PATH, idx);
+		// the reader threads must not sleep in read() when read_block is set, a drained file returns EAGAIN
+		fd = open(path, O_RDONLY | O_NONBLOCK);
+		if (fd < 0) {
+			continue;
+		}
+		reader = &readers[nr_readers++];
+		reader->fd = fd;
+		reader->cpu = idx;
+		if (skip_stored && lseek(fd, 0, SEEK_END) < 0) {
+			errors = errno;
+			fprintf(stderr, "Failed to skip the stored records of %s\n", path);
+			goto cleanup;
+		}
+		reader->compact = record_format();
+		reader->records = malloc(USER_ROUND_RECORDS * sizeof(page_fault_data));
+		reader->batch = malloc(USER_READ_BATCH * sizeof(page_fault_data));
+		if (reader->records == NULL || reader->batch == NULL) {
+			errors = ENOMEM;
+			goto cleanup;
+		}
+		pfds[nr_readers - 1].fd = fd;
+		pfds[nr_readers - 1].events = POLLIN;
+	}
+	if (nr_readers == 0) {
+		fprintf(stderr, "Failed to open any CPU file like %s, of %s\n", DRIVER_CPU_PATH, DRIVER_NAME);
+		errors = ENOENT;
+		goto cleanup;
+	}
+	if (USER_DEBUG) {
+		printf("Reading %d CPU files with one thread each\n", nr_readers);
+	}
+	// the threads inherit a mask without SIGINT, so Ctrl-C interrupts the poll() of this thread
+	sigemptyset(&sigint);
+	sigaddset(&sigint, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &sigint, &old_mask);
+	pthread_mutex_lock(&readers_lock);
+	for (nr_started = 0; nr_started < nr_readers; nr_started++) {
+		readers[nr_started].start = &start_barrier;
+		readers[nr_started].done = &done_barrier;
+		errors = pthread_create(&readers[nr_started].thread, NULL, cpu_reader_thread, &readers[nr_started]);
+		if (errors != 0) {
+			fprintf(stderr, "Failed to start the reader of CPU %d\n", readers[nr_started].cpu);
+			readers_stop = 1;
+			break;
+		}
+	}
+	pthread_barrier_init(&start_barrier, NULL, nr_started + 1);
+	pthread_barrier_init(&done_barrier, NULL, nr_started + 1);
+	pthread_mutex_unlock(&readers_lock);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	// every round the threads drain their files in parallel, then this thread merges what they collected
+	while (!readers_stop && !stop_reading) {
+		pthread_barrier_wait(&start_barrier);
+		pthread_barrier_wait(&done_barrier);
+		collected = 0;
+		for (idx = 0; idx < nr_readers; idx++) {
+			collected += readers[idx].count;
+			if (readers[idx].error != 0 && errors == 0) {
+				errors = readers[idx].error;
+				fprintf(stderr, "Failed to read CPU %d, load the module with read_binary=1: %s\n", readers[idx].cpu, strerror(errors));
+			}
+		}
+		count = merge_cpu_readers(log_file, readers, heap, nr_readers, count);
+		if (errors != 0 || (collected == 0 && !follow)) {
+			break;
+		}
+		if (collected == 0) {
+			// every file is drained, sleep until any CPU has new records
+			while (poll(pfds, nr_readers, -1) < 0 && errno == EINTR && !stop_reading) {
+			}
+		}
+	}
+	// the threads that started leave their loop at the next start
+	readers_stop = 1;
+	pthread_barrier_wait(&start_barrier);
+	for (idx = 0; idx < nr_started; idx++) {
+		pthread_join(readers[idx].thread, NULL);
+	}
+	pthread_barrier_destroy(&start_barrier);
+	pthread_barrier_destroy(&done_barrier);
+	if (errors == 0) {
+		printf("Reading %d records from %d CPU files Completed\n", count, nr_readers);
+	}
+
+cleanup:
+	for (idx = 0; idx < nr_readers; idx++) {
+		close(readers[idx].fd);
+		free(readers[idx].records);
+		free(readers[idx].batch);
+	}
+	free(readers);
+	free(heap);
+	free(pfds);
+	return errors;
+}
+
+
+/*
+ * Next fault of a mapped ring from *pos up to its head in either record format, pack is only used for compact rings.
+ * With cont_store the module can come round to a slot while it is copied, so each copy is checked against
+ * the head read after it and thrown away, skipping to the oldest slot left, if it was written over.
+ */
+int ring_next_entry(page_fault_mmap_info *info, page_fault_ring_ctrl *ctrl, uint64_t *pos, page_fault_pack *pack, page_fault_data *entry) {
+
+	long page_size = sysconf(_SC_PAGESIZE);
+	uint64_t head = __atomic_load_n(&ctrl->head, __ATOMIC_ACQUIRE);
+	uint64_t start = __atomic_load_n(&ctrl->start, __ATOMIC_ACQUIRE);
+	// the module may be writing this many slots past the head it has published
+	uint64_t margin = info->compact ? PROBE_PACK_MAX_WORDS : 1;
+	uint64_t now;
+	uint64_t word = 0;
+	page_fault_data copy;
+	char *data = (char *)ctrl + page_size;
+
+	if (*pos < start) {
+		// a reset through /proc/pf_probe_B/ctl dropped the records up to start
+		*pos = start;
+		memset(pack, 0, sizeof(page_fault_pack));
+	}
+	if (head - *pos > info->ring_size) {
+		// lapped by a module with cont_store, the slots up to the oldest one left are gone
+		*pos = head - info->ring_size;
+		memset(pack, 0, sizeof(page_fault_pack));
+	}
+	while (*pos < head) {
+		if (info->compact == 0) {
+			copy = ((volatile page_fault_data *)data)[*pos % info->ring_size];
+		}
+		else {
+			word = __atomic_load_n(&((uint64_t *)data)[*pos % info->ring_size], __ATOMIC_RELAXED);
+		}
+		// the copy is done before head is read again
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		now = __atomic_load_n(&ctrl->head, __ATOMIC_RELAXED);
+		if (*pos + info->ring_size < now + margin) {
+			*pos = now + margin - info->ring_size;
+			memset(pack, 0, sizeof(page_fault_pack));
+			continue;
+		}
+		*pos += 1;
+		if (info->compact == 0) {
+			*entry = copy;
+			return 1;
+		}
+		if (unpack_fault(pack, word, info->compact, entry)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/* Consume records in place from the rings shared by the module, oldest first across all rings */
+int read_mmap_mode(FILE *log_file) {
+
+	int fd;
+	int count = 0;
+	int best;
+	uint32_t ring;
+	uint64_t pos;
+	uint64_t best_pos = 0;
+	uint64_t *tails;
+	size_t map_size;
+	char *map;
+	page_fault_mmap_info *info;
+	page_fault_ring_ctrl *ctrl;
+	page_fault_pack *packs;
+	page_fault_pack pack;
+	page_fault_pack best_pack = { 0 };
+	page_fault_data entry;
+	page_fault_data next;
+	long page_size = sysconf(_SC_PAGESIZE);
+
+	fd = open(DRIVER_PATH, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open path %s, of %s\n", DRIVER_PATH, DRIVER_NAME);
+		return errno;
+	}
+	info = mmap(NULL, page_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (info == MAP_FAILED || info->magic != PROBE_MMAP_MAGIC || info->record_size != (info->compact ? sizeof(uint64_t) : sizeof(page_fault_data))) {
+		fprintf(stderr, "Failed to map info page of %s\n", DRIVER_PATH);
+		close(fd);
+		return EINVAL;
+	}
+	map_size = (1 + (size_t)info->nr_rings * info->ring_pages) * page_size;
+	munmap(info, page_size);
+	map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Failed to map rings of %s\n", DRIVER_PATH);
+		close(fd);
+		return errno;
+	}
+	info = (page_fault_mmap_info *)map;
+	tails = calloc(info->nr_rings, sizeof(uint64_t));
+	packs = calloc(info->nr_rings, sizeof(page_fault_pack));
+	for (ring = 0; ring < info->nr_rings; ring++) {
+		ctrl = (page_fault_ring_ctrl *)(map + (1 + (size_t)ring * info->ring_pages) * page_size);
+		tails[ring] = ctrl->tail;
+	}
+	if (USER_DEBUG) {
+		printf("Mapped %u rings of %u entries from %s\n", info->nr_rings, info->ring_size, DRIVER_PATH);
+	}
+
+	while (!stop_reading) {
+		best = -1;
+		for (ring = 0; ring < info->nr_rings; ring++) {
+			ctrl = (page_fault_ring_ctrl *)(map + (1 + (size_t)ring * info->ring_pages) * page_size);
+			pos = tails[ring];
+			pack = packs[ring];
+			if (!ring_next_entry(info, ctrl, &pos, &pack, &next)) {
+				if (pos != tails[ring]) {
+					// only escape words were left, hand them back
+					tails[ring] = pos;
+					packs[ring] = pack;
+					__atomic_store_n(&ctrl->tail, tails[ring], __ATOMIC_RELEASE);
+				}
+				continue;
+			}
+			if (best < 0 || next.time < entry.time) {
+				best = ring;
+				entry = next;
+				best_pos = pos;
+				best_pack = pack;
+			}
+		}
+		if (best < 0) {
+			// nothing new in any ring, back off instead of spinning
+			usleep(USER_SLEEP * 1000);
+			continue;
+		}
+		log_record(log_file, count, &entry);
+		count += 1;
+		ctrl = (page_fault_ring_ctrl *)(map + (1 + (size_t)best * info->ring_pages) * page_size);
+		tails[best] = best_pos;
+		packs[best] = best_pack;
+		// hand the slots back to the module once the entry is consumed
+		__atomic_store_n(&ctrl->tail, tails[best], __ATOMIC_RELEASE);
+	}
+	printf("Reading %d records from the rings of %s Completed\n", count, DRIVER_PATH);
+	free(tails);
+	free(packs);
+	munmap(map, map_size);
+	close(fd);
+	return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+
+	int opt;
+	int errors;
+	int use_mmap = 0;
+	int use_binary = 0;
+	int use_cpus = 0;
+	int use_trace = 0;
+	char *convert = NULL;
+	long from = 0;
+	long to = LONG_MAX;
+	FILE *log_file;
+	struct sigaction action;
+
+	while ((opt = getopt(argc, argv, "bfmnptx:s:e:")) != -1) {
+		switch (opt) {
+			case 'b':
+				use_binary = 1;
+				break;
+			case 'f':
+				follow = 1;
+				break;
+			case 'm':
+				use_mmap = 1;
+				break;
+			case 'n':
+				skip_stored = 1;
+				break;
+			case 'p':
+				use_cpus = 1;
+				break;
+			case 't':
+				use_trace = 1;
+				break;
+			case 'x':
+				convert = optarg;
+				break;
+			case 's':
+				from = strtol(optarg, NULL, 0);
+				break;
+			case 'e':
+				to = strtol(optarg, NULL, 0);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-b | -m | -p] [-f] [-n] [-t]\n       %s -x <trace> [-s <from nsec>] [-e <to nsec>]\n", argv[0], argv[0]);
+				fprintf(stderr, "  -b  read raw records in large blocks, needs read_binary=1\n");
+				fprintf(stderr, "  -f  keep collecting, wait in poll() once the module is drained\n");
+				fprintf(stderr, "  -m  consume records from shared memory instead of reading lines\n");
+				fprintf(stderr, "  -p  one pinned reader thread per /proc/pf_probe_B/cpuN, merged in time order, needs read_binary=1\n");
+				fprintf(stderr, "  -n  only collect faults stored after start, not the ones already in the rings\n");
+				fprintf(stderr, "  -t  write a binary trace to %s instead of the text log, with -b, -m or -p\n", PROBE_TRACE_NAME);
+				fprintf(stderr, "  -x  print a binary trace as text lines, -s and -e keep only a time range\n");
+				return EINVAL;
+		}
+	}
+	if (convert != NULL) {
+		return convert_trace(convert, from, to);
+	}
+	if (skip_stored && use_mmap) {
+		fprintf(stderr, "-n works on the read cursor, -m consumes the rings in place\n");
+		return EINVAL;
+	}
+	if (use_trace && !use_binary && !use_mmap && !use_cpus) {
+		fprintf(stderr, "-t needs the records of -b, -m or -p\n");
+		return EINVAL;
+	}
+
+	printf("This is a simple program to interact with %s\n", DRIVER_NAME);
+
+	if (use_trace) {
+		trace = trace_open(PROBE_TRACE_NAME);
+		if (trace == NULL) {
+			fprintf(stderr, "Failed to create trace path %s\n", PROBE_TRACE_NAME);
+			return errno;
+		}
+	}
+	log_file = fopen(PROBE_LOG_NAME, "w");
+	if (log_file == NULL) {
+		fprintf(stderr, "Failed to create log path %s\n", PROBE_LOG_NAME);
+		return errno;
+	}
+	// no SA_RESTART, a read() or poll() sleeping for records returns so the loops see stop_reading
+	sigemptyset(&action.sa_mask);
+	action.sa_handler = exit_handler;
+	action.sa_flags = 0;
+	sigaction(SIGINT, &action, NULL);
+	if (use_mmap) {
+		errors = read_mmap_mode(log_file);
+	}
+	else if (use_cpus) {
+		errors = read_cpu_mode(log_file);
+	}
+	else if (use_binary) {
+		errors = read_binary_mode(log_file);
+	}
+	else {
+		errors = read_text_mode(log_file);
+	}
+	trace_close();
+	fclose(log_file);
+	return errors != 0 ? errors : trace_errors;
+}